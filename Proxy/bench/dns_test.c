@@ -0,0 +1,288 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * dns_test.c: test driver of the resolver cache in dns.c
+ *     getaddrinfo(), freeaddrinfo() and clock_gettime() are replaced here,
+ *     so dns.c asks a stub resolver with a fixed table of hosts and reads
+ *     a clock the driver moves by hand. It checks that positive and
+ *     negative entries expire after their TTL, that an entry used close to
+ *     its end is refreshed in the background (and kept if the refresh
+ *     fails), and that the last good address is returned first.
+ * 
+ * Build and run from the Proxy folder:
+ *     gcc -O2 -pthread -I. -o dns_test bench/dns_test.c dns.c csapp.c
+ *     ./dns_test
+ */
+
+#include "csapp.h"
+#include "dns.h"
+
+#define TEST_TTL 10 /* Seconds, refresh starts in the last 2 */
+#define TEST_PORT "80"
+
+/* Stub resolver: good.test has two addresses (the second one changes
+ * when answer is set), anything else can't be resolved */
+static volatile time_t fake_now = 1000;
+static volatile int resolver_calls = 0;
+static volatile int resolver_down = 0; /* 1 = every lookup fails */
+static volatile int answer = 2; /* Last byte of the second address */
+
+/* Helper functions */
+static int check_positive_ttl(void);
+static int check_negative_ttl(void);
+static int check_refresh(void);
+static int check_last_good(void);
+static int check(int ok, char *what);
+static int last_byte(dns_addr *addr);
+static void wait_refresh(dns_cache *dns);
+
+int 
+main(void) {
+    int failed = 0;
+    
+    failed += check_positive_ttl();
+    failed += check_negative_ttl();
+    failed += check_refresh();
+    failed += check_last_good();
+    
+    printf(failed ? "%d checks failed\n" : "All checks passed\n", failed);
+    return failed ? 1 : 0;
+}
+
+/*
+ * check_positive_ttl: addresses are served from the cache until the TTL
+ *      ends, then asked again
+ * 
+ * return number of failed checks
+ */
+static int 
+check_positive_ttl(void) {
+    dns_cache *dns = init_dns_cache(TEST_TTL);
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int failed = 0, calls = resolver_calls;
+    
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    resolver_calls == calls + 1, "positive: first lookup asks resolver");
+    
+    fake_now += TEST_TTL / 2;
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    resolver_calls == calls + 1, "positive: cached before the TTL ends");
+    
+    fake_now += TEST_TTL - TEST_TTL / 2;
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    resolver_calls == calls + 2, "positive: asked again once expired");
+    
+    return failed;
+}
+
+/*
+ * check_negative_ttl: a failed lookup is remembered for DNS_NEGATIVE_TTL
+ *      seconds, then asked again
+ * 
+ * return number of failed checks
+ */
+static int 
+check_negative_ttl(void) {
+    dns_cache *dns = init_dns_cache(TEST_TTL);
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int failed = 0, calls = resolver_calls;
+    
+    failed += check(dns_resolve(dns, "bad.test", TEST_PORT, addrs) == -1 && 
+    resolver_calls == calls + 1, "negative: first lookup asks resolver");
+    
+    fake_now += DNS_NEGATIVE_TTL - 1;
+    failed += check(dns_resolve(dns, "bad.test", TEST_PORT, addrs) == -1 && 
+    resolver_calls == calls + 1 && dns->negative_hits == 1, 
+    "negative: fails from the cache before it expires");
+    
+    fake_now += 1;
+    failed += check(dns_resolve(dns, "bad.test", TEST_PORT, addrs) == -1 && 
+    resolver_calls == calls + 2, "negative: asked again once expired");
+    
+    return failed;
+}
+
+/*
+ * check_refresh: an entry used in its last DNS_REFRESH_PERCENT is
+ *      resolved again in the background. The old addresses are served
+ *      meanwhile, and kept if the refresh fails.
+ * 
+ * return number of failed checks
+ */
+static int 
+check_refresh(void) {
+    dns_cache *dns = init_dns_cache(TEST_TTL);
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int failed = 0, calls = resolver_calls;
+    
+    dns_resolve(dns, "good.test", TEST_PORT, addrs);
+    
+    /* Not close to the end yet */
+    fake_now += TEST_TTL / 2;
+    dns_resolve(dns, "good.test", TEST_PORT, addrs);
+    failed += check(dns->refreshes == 0, "refresh: not in the middle");
+    
+    /* Served the old answer, the new one is there after the refresh */
+    answer = 3;
+    fake_now += TEST_TTL - TEST_TTL / 2 - 1;
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    last_byte(&addrs[1]) == 2 && dns->refreshes == 1, 
+    "refresh: old answer served while refreshing");
+    wait_refresh(dns);
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    last_byte(&addrs[1]) == 3 && resolver_calls == calls + 2, 
+    "refresh: new answer without waiting for resolver");
+    
+    /* The refresh gave a full TTL */
+    fake_now += TEST_TTL / 2;
+    dns_resolve(dns, "good.test", TEST_PORT, addrs);
+    failed += check(resolver_calls == calls + 2, 
+    "refresh: entry lives a TTL from the refresh");
+    
+    /* A failed refresh keeps the addresses until they expire */
+    resolver_down = 1;
+    fake_now += TEST_TTL / 2 - 1;
+    dns_resolve(dns, "good.test", TEST_PORT, addrs);
+    wait_refresh(dns);
+    failed += check(dns->refreshes == 2 && resolver_calls == calls + 3 && 
+    dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2, 
+    "refresh: failed refresh keeps the addresses");
+    
+    /* Still in the last part, that use started another one */
+    wait_refresh(dns);
+    resolver_down = 0;
+    answer = 2;
+    
+    return failed;
+}
+
+/*
+ * check_last_good: the address dns_connected() was told about comes first,
+ *      the others follow
+ * 
+ * return number of failed checks
+ */
+static int 
+check_last_good(void) {
+    dns_cache *dns = init_dns_cache(TEST_TTL);
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int failed = 0;
+    
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    last_byte(&addrs[0]) == 1, "last good: resolver order at first");
+    
+    dns_connected(dns, "good.test", TEST_PORT, 
+    (struct sockaddr *)&addrs[1].addr, addrs[1].addrlen);
+    failed += check(dns_resolve(dns, "good.test", TEST_PORT, addrs) == 2 && 
+    last_byte(&addrs[0]) == 2 && last_byte(&addrs[1]) == 1, 
+    "last good: connected address first");
+    
+    /* Another port is another entry */
+    failed += check(dns_resolve(dns, "good.test", "8080", addrs) == 2 && 
+    last_byte(&addrs[0]) == 1, "last good: only for its host:port");
+    
+    return failed;
+}
+
+/*
+ * check: print the result of one check
+ * 
+ * return 0 = passed, 1 = failed
+ */
+static int 
+check(int ok, char *what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    return ok ? 0 : 1;
+}
+
+/*
+ * last_byte: last byte of an IPv4 address from the stub resolver
+ */
+static int 
+last_byte(dns_addr *addr) {
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr->addr;
+    
+    return ntohl(in->sin_addr.s_addr) & 0xff;
+}
+
+/*
+ * wait_refresh: wait until no refresh thread is running
+ */
+static void 
+wait_refresh(dns_cache *dns) {
+    dns_entry *entry;
+    int i, running;
+    
+    do {
+        usleep(1000);
+        running = 0;
+        P(&dns->mutex);
+        for (i = 0; i < DNS_BUCKETS; i++) {
+            for (entry = dns->buckets[i]; entry != NULL; 
+            entry = entry->next) {
+                running |= entry->refreshing;
+            }
+        }
+        V(&dns->mutex);
+    } while (running);
+}
+
+/*
+ * getaddrinfo: stub resolver, good.test is 10.0.0.1 and 10.0.0.<answer>
+ */
+int 
+getaddrinfo(const char *node, const char *service, 
+const struct addrinfo *hints, struct addrinfo **res) {
+    struct addrinfo *list = NULL, *ai;
+    struct sockaddr_in *in;
+    int i;
+    
+    (void)hints;
+    __sync_add_and_fetch(&resolver_calls, 1);
+    if (resolver_down || strcmp(node, "good.test")) {
+        return EAI_NONAME;
+    }
+    
+    for (i = 1; i >= 0; i--) {
+        ai = (struct addrinfo *)calloc(1, sizeof(struct addrinfo));
+        in = (struct sockaddr_in *)calloc(1, sizeof(struct sockaddr_in));
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(service));
+        in->sin_addr.s_addr = htonl(0x0a000000 | (i ? answer : 1));
+        ai->ai_family = AF_INET;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_addr = (struct sockaddr *)in;
+        ai->ai_addrlen = sizeof(struct sockaddr_in);
+        ai->ai_next = list;
+        list = ai;
+    }
+    
+    *res = list;
+    return 0;
+}
+
+/*
+ * freeaddrinfo: free the list of the stub resolver
+ */
+void 
+freeaddrinfo(struct addrinfo *res) {
+    struct addrinfo *next;
+    
+    for (; res != NULL; res = next) {
+        next = res->ai_next;
+        free(res->ai_addr);
+        free(res);
+    }
+}
+
+/*
+ * clock_gettime: the clock of the driver, moved by hand
+ */
+int 
+clock_gettime(clockid_t clk_id, struct timespec *tp) {
+    (void)clk_id;
+    tp->tv_sec = fake_now;
+    tp->tv_nsec = 0;
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * parse_bench.c: microbenchmark of the request line parsers in http.c
+ *     Times parse_request_line() (views only), parse_request() (views copied
+ *     into the caller buffers) and the sscanf parser parse_request() used
+ *     before them, kept here as old_parse_request(), on a few request lines.
+ *     It also checks that parse_request() gives the same fields as the old
+ *     parser for each line.
+ * 
+ * Build and run from the Proxy folder:
+ *     gcc -O2 -pthread -I. -o parse_bench bench/parse_bench.c http.c csapp.c
+ *     ./parse_bench [iterations]
+ */
+
+#include "csapp.h"
+#include "http.h"
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+/* Request lines to parse, as read from client with Rio_readlineb */
+static char *lines[] = {
+    "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n", 
+    "GET http://localhost:15213/home.html HTTP/1.0\r\n", 
+    "GET http://www.example.com HTTP/1.1\r\n", 
+    "GET www.example.com:8080/a/b/c?x=1&y=2 HTTP/1.1\r\n", 
+    "GET http://images.example.com/static/img/2014/09/banner-large.png"
+    "?v=20140901&size=1280x720&cache=0 HTTP/1.1\r\n", 
+    "POST http://api.example.com:8000/v1/items HTTP/1.1\r\n", 
+};
+
+#define LINE_COUNT (int)(sizeof(lines) / sizeof(lines[0]))
+
+/* Helper functions */
+static int old_parse_request(char *req, char *method, 
+char *protocol, char *host, char *uri, char *port, char *ver);
+static int check_lines(void);
+static double now(void);
+
+int 
+main(int argc, char **argv) {
+    char method[MAXLINE], protocol[MAXLINE], host[MAXLINE];
+    char uri[MAXLINE], port[MAXLINE], version[MAXLINE];
+    http_request_line request;
+    long iterations = DEFAULT_ITERATIONS;
+    long i, sum;
+    double start, old_time, copy_time, view_time;
+    int j;
+    
+    if (argc > 1) {
+        iterations = atol(argv[1]);
+    }
+    
+    if (check_lines() < 0) {
+        return 1;
+    }
+    
+    /* sum keeps the compiler from dropping the calls */
+    sum = 0;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < LINE_COUNT; j++) {
+            sum += old_parse_request(lines[j], 
+            method, protocol, host, uri, port, version);
+        }
+    }
+    old_time = now() - start;
+    
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < LINE_COUNT; j++) {
+            sum += parse_request(lines[j], 
+            method, protocol, host, uri, port, version);
+        }
+    }
+    copy_time = now() - start;
+    
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < LINE_COUNT; j++) {
+            sum += parse_request_line(lines[j], strlen(lines[j]), &request);
+            sum += request.path.len;
+        }
+    }
+    view_time = now() - start;
+    
+    iterations *= LINE_COUNT;
+    printf("%ld lines (sum %ld)\n", iterations, sum);
+    printf("sscanf parse_request:  %8.1f ns/line\n", 
+    old_time * 1e9 / iterations);
+    printf("parse_request:         %8.1f ns/line\n", 
+    copy_time * 1e9 / iterations);
+    printf("parse_request_line:    %8.1f ns/line\n", 
+    view_time * 1e9 / iterations);
+    return 0;
+}
+
+/*
+ * check_lines: compare parse_request() with old_parse_request() on each
+ *      line
+ * 
+ * return 0 = same fields, -1 = a field is different
+ */
+static int 
+check_lines(void) {
+    char old[6][MAXLINE], new[6][MAXLINE];
+    int j, k, old_rc, new_rc;
+    
+    for (j = 0; j < LINE_COUNT; j++) {
+        old_rc = old_parse_request(lines[j], 
+        old[0], old[1], old[2], old[3], old[4], old[5]);
+        new_rc = parse_request(lines[j], 
+        new[0], new[1], new[2], new[3], new[4], new[5]);
+        if (old_rc != new_rc) {
+            printf("Mismatch on %s", lines[j]);
+            return -1;
+        }
+        for (k = 0; k < 6 && old_rc == 1; k++) {
+            if (strcmp(old[k], new[k])) {
+                printf("Mismatch on %s  old \"%s\", new \"%s\"\n", 
+                lines[j], old[k], new[k]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * now: monotonic time in seconds
+ */
+static double 
+now(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * old_parse_request: parse_request() as it was with sscanf, with the same
+ *      default protocol and port and forced HTTP/1.0
+ * 
+ * return 1 = success, -1 = error
+ */
+static int 
+old_parse_request(char *req, char *method, 
+char *protocol, char *host, char *uri, char *port, char *ver) {
+    char url[MAXLINE];
+    char host_port_uri[MAXLINE];
+    char host_port[MAXLINE];
+    
+    /* Invalid request length */
+    if (strlen(req) < 1) {
+        return -1;
+    }
+    
+    /* Decompose into 3 parts */
+    sscanf(req, "%s %s %s", method, url, ver);
+    
+    /* Version check */
+    if (strstr(ver, "/") == NULL) {
+        return -1;
+    }
+    
+    /* Look for protocol */
+    if (strstr(url, "://") == NULL) {
+        sscanf(url, "%s", host_port_uri);
+        strcpy(protocol, "http");
+    }
+    else {
+        sscanf(url, "%[^:]://%s", protocol, host_port_uri);
+    }
+    
+    strcpy(uri, "/");
+    
+    /* Look for the port and uri (if possible) */
+    if (strstr(host_port_uri, "/") != NULL) {
+        sscanf(host_port_uri, "%[^/]%s", host_port, uri);
+    }
+    else {
+        sscanf(host_port_uri, "%s", host_port);
+    }
+    
+    /* Split host and port (if port is included) */
+    if ((strstr(host_port, ":")) != NULL) {
+        sscanf(host_port, "%[^:]:%s", host, port);
+        if (atoi(port) == 0) {
+            strcpy(port, "80");
+        }
+    }
+    else {
+        sscanf(host_port, "%s", host);
+        strcpy(port, "80");
+    }
+    
+    strcpy(ver, "HTTP/1.0");
+    
+    /* Empty host */
+    if (!strcmp(host, "")) {
+        return -1;
+    }
+    
+    return 1;
+}
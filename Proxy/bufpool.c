@@ -0,0 +1,149 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * bufpool.c: implementation of bufpool.h, pool of response buffers
+ */
+
+#include "bufpool.h"
+
+/* Functions prototype used only in bufpool.c */
+static void put_shared(buffer_pool *pool, void *buf);
+
+/* Functions */
+
+/*
+ * init_buffer_pool: Create an empty pool of buffers of size bytes, the
+ *      shared stack keeps at most max_free of them
+ * 
+ * return pool pointer if success, NULL if not enough space
+ */
+buffer_pool 
+*init_buffer_pool(size_t size, int max_free) {
+    buffer_pool *pool;
+    
+    if ((pool = (buffer_pool *)Malloc(sizeof(buffer_pool))) == NULL) {
+        return NULL;
+    }
+    if ((pool->free = (void **)Calloc(max_free > 0 ? max_free : 1, 
+    sizeof(void *))) == NULL) {
+        Free(pool);
+        return NULL;
+    }
+    
+    pool->size = size;
+    pool->max_free = max_free;
+    pool->free_count = 0;
+    pool->taken = 0;
+    pool->worker_reused = 0;
+    pool->shared_reused = 0;
+    pool->allocated = 0;
+    pool->freed = 0;
+    Sem_init(&pool->mutex, 0, 1);
+    
+    return pool;
+}
+
+/*
+ * init_buffer_cache: Start an empty buffer_cache of a worker on pool, it
+ *      keeps at most max free buffers
+ */
+void 
+init_buffer_cache(buffer_cache *cache, buffer_pool *pool, int max) {
+    cache->pool = pool;
+    cache->max = max < BUFFER_CACHE_SIZE ? max : BUFFER_CACHE_SIZE;
+    cache->count = 0;
+}
+
+/*
+ * get_buffer: Take a buffer of pool size bytes, from the worker first, then
+ *      the shared stack, then a new one. The content is not cleared.
+ * 
+ * return buffer pointer, NULL if the worker has no pool
+ */
+void 
+*get_buffer(buffer_cache *cache) {
+    buffer_pool *pool = cache->pool;
+    void *buf = NULL;
+    
+    if (pool == NULL) {
+        return NULL;
+    }
+    __sync_add_and_fetch(&pool->taken, 1);
+    
+    /* Worker's own buffer */
+    if (cache->count > 0) {
+        __sync_add_and_fetch(&pool->worker_reused, 1);
+        return cache->free[--cache->count];
+    }
+    
+    /* Shared buffer */
+    P(&pool->mutex);
+    if (pool->free_count > 0) {
+        buf = pool->free[--pool->free_count];
+    }
+    V(&pool->mutex);
+    if (buf != NULL) {
+        __sync_add_and_fetch(&pool->shared_reused, 1);
+        return buf;
+    }
+    
+    __sync_add_and_fetch(&pool->allocated, 1);
+    return Malloc(pool->size);
+}
+
+/*
+ * put_buffer: Give buf from get_buffer() back, to the worker if it has
+ *      room, else to the shared stack
+ */
+void 
+put_buffer(buffer_cache *cache, void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    
+    if (cache->count < cache->max) {
+        cache->free[cache->count++] = buf;
+        return;
+    }
+    put_shared(cache->pool, buf);
+}
+
+/*
+ * put_shared: Push buf on the shared stack, free it if the stack is full
+ */
+void 
+put_shared(buffer_pool *pool, void *buf) {
+    P(&pool->mutex);
+    if (pool->free_count < pool->max_free) {
+        pool->free[pool->free_count++] = buf;
+        buf = NULL;
+    }
+    V(&pool->mutex);
+    
+    if (buf != NULL) {
+        __sync_add_and_fetch(&pool->freed, 1);
+        Free(buf);
+    }
+}
+
+/*
+ * print_buffer_pool_stats: Print how many buffers were taken, reused and
+ *      allocated to fp.
+ */
+void 
+print_buffer_pool_stats(buffer_pool *pool, FILE *fp) {
+    int free_count;
+    
+    P(&pool->mutex);
+    free_count = pool->free_count;
+    V(&pool->mutex);
+    
+    fprintf(fp, "Buffers: %lu taken, %lu reused by worker, %lu reused "
+    "shared, %lu allocated, %lu freed, %d free\n", 
+    __atomic_load_n(&pool->taken, __ATOMIC_RELAXED), 
+    __atomic_load_n(&pool->worker_reused, __ATOMIC_RELAXED), 
+    __atomic_load_n(&pool->shared_reused, __ATOMIC_RELAXED), 
+    __atomic_load_n(&pool->allocated, __ATOMIC_RELAXED), 
+    __atomic_load_n(&pool->freed, __ATOMIC_RELAXED), free_count);
+}
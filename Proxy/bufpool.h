@@ -0,0 +1,60 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * bufpool.h: header file for the pool of response buffers
+ *     A request that may fill the cache needs a buffer of a whole object to
+ *     keep the response in. Instead of one on the stack of every request,
+ *     the buffers are taken from the pool only by the requests that need
+ *     one (cache misses) and given back after the response.
+ * 
+ * Structure: The pool keeps a shared stack of free buffers. Each worker has
+ *     its own buffer_cache of up to BUFFER_CACHE_SIZE free buffers in front
+ *     of it, used without locking, so a worker that serves request after
+ *     request keeps using the same buffer.
+ * 
+ * Limits: The shared stack keeps at most max_free buffers and a worker at
+ *     most the max given to init_buffer_cache(), a buffer given back when
+ *     both are full is freed. A worker that only lives for one connection
+ *     uses max 0, so its idle connection doesn't hold a buffer.
+ * 
+ * Synchronization: One mutex protects the shared stack. The statistics are
+ *     updated with atomic adds.
+ */
+
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include "csapp.h"
+
+#define BUFFER_CACHE_SIZE 1 /* Most free buffers a worker keeps */
+
+typedef struct buffer_pool {
+    size_t size; /* Bytes of each buffer */
+    int max_free; /* Most free buffers in the shared stack */
+    int free_count;
+    void **free; /* Shared stack of free buffers */
+    unsigned long taken; /* Statistics */
+    unsigned long worker_reused; /* Taken from the buffer_cache */
+    unsigned long shared_reused; /* Taken from the shared stack */
+    unsigned long allocated;
+    unsigned long freed; /* Given back when the lists were full */
+    sem_t mutex; /* Protects free and free_count */
+} buffer_pool;
+
+/* Free buffers of one worker */
+typedef struct buffer_cache {
+    buffer_pool *pool;
+    int max; /* Most free buffers kept, up to BUFFER_CACHE_SIZE */
+    int count;
+    void *free[BUFFER_CACHE_SIZE];
+} buffer_cache;
+
+/* Functions used in proxy.c */
+buffer_pool *init_buffer_pool(size_t size, int max_free);
+void init_buffer_cache(buffer_cache *cache, buffer_pool *pool, int max);
+void *get_buffer(buffer_cache *cache);
+void put_buffer(buffer_cache *cache, void *buf);
+void print_buffer_pool_stats(buffer_pool *pool, FILE *fp);
+
+#endif /* __BUFPOOL_H__ */
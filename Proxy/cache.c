@@ -4,39 +4,101 @@
  * 
  * cache.c: implementation of cache.h and the helper functions used in cache
  * 
- * Eviction policy: LRU
+ * Eviction policy: LRU, CLOCK or GDSF, see cache.h
+ * 
+ * Admission policy: admit all or TinyLFU, see cache.h
  * 
  * Insert policy: Always insert most recently used or new block at the root.
  *     Thus, the LRU block will always be at the end of the block list.
  * 
  * Prioritization: Readers has higher priority
+ * 
+ * Lookup: Hash index on (host, uri) with incremental rehash, see cache.h
  */
 
 #include "cache.h"
 
 /* Functions prototype used only in cache.c */
-static cache_block *create_block(char *input_host, 
-char *input_uri, void *buffer, int size);
+static cache_block *create_block(slab_arena *arena, unsigned int hash, 
+char *input_host, char *input_uri, void *buffer, int size, char *etag, 
+char *last_modified);
+static size_t block_size(char *input_host, char *input_uri, char *etag, 
+char *last_modified, int size);
 
+static cache_block *create_fill_block(slab_arena *arena, unsigned int hash, 
+char *input_host, char *input_uri, int limit);
 static void free_block(cache_block *block_ptr);
-static void insert_block(proxy_cache *my_cache, cache_block *block_ptr);
-static void remove_block(proxy_cache *my_cache, cache_block *block_ptr);
-static cache_block *search_block(proxy_cache *my_cache, 
+static void insert_block(cache_shard *shard, cache_block *block_ptr);
+static void remove_block(cache_shard *shard, cache_block *block_ptr);
+static cache_block *search_block(cache_shard *shard, unsigned int hash, 
 char *input_host, char* input_uri);
 
+static unsigned int hash_key(char *input_host, char *input_uri);
+static cache_shard *get_shard(proxy_cache *my_cache, unsigned int hash);
+static int table_init(cache_table *table, unsigned int size);
+static void table_insert(cache_shard *shard, cache_block *block_ptr);
+static void table_remove(cache_shard *shard, cache_block *block_ptr);
+static int table_unlink(cache_table *table, cache_block *block_ptr);
+static void rehash_step(cache_shard *shard, int steps);
+
 static int read_cache_block(cache_block *block_ptr, void *buffer);
-static void lru_update(proxy_cache *my_cache, cache_block *block_ptr);
-static cache_block *get_lru(proxy_cache *my_cache);
-static void eviction(proxy_cache *my_cache);
+static void read_lock(cache_shard *shard);
+static void read_unlock(cache_shard *shard);
+static void release_block(cache_block *block_ptr);
+static cache_block *pin_block(cache_shard *shard, unsigned int hash, 
+char *input_host, char *input_uri);
+static void hit_update(proxy_cache *my_cache, cache_shard *shard, 
+cache_block *block_ptr);
+static void unlink_block(proxy_cache *my_cache, cache_shard *shard, 
+cache_block *block_ptr);
+static int store_block(proxy_cache *my_cache, cache_shard *shard, 
+unsigned int hash, char *input_host, char *input_uri, void *buffer, int len, 
+int ttl, char *etag, char *last_modified, cache_block *fill_ptr);
+static unsigned long cache_now(void);
+static int block_expired(cache_block *block_ptr);
+static char *copy_validator(char *dst, char *validator, size_t len);
+static void wake_fill(cache_fill *state_ptr);
+static void finish_fill(cache_block *fill_ptr, int state);
+static void lru_update(cache_shard *shard, cache_block *block_ptr);
+static cache_block *get_lru(cache_shard *shard);
+static cache_block *eviction(cache_shard *shard, unsigned int len);
+static cache_block *clock_eviction(cache_shard *shard, unsigned int len);
+static void release_victims(cache_block *victim_ptr);
+
+static unsigned int sketch_index(unsigned int hash, int row);
+static void sketch_increment(cache_sketch *sketch, unsigned int hash);
+static int sketch_frequency(cache_sketch *sketch, unsigned int hash);
+static void sketch_age(cache_sketch *sketch);
+static int admit_block(proxy_cache *my_cache, cache_shard *shard, 
+unsigned int hash);
+
+static double gdsf_priority(cache_shard *shard, cache_block *block_ptr);
+static int heap_reserve(cache_shard *shard);
+static void heap_push(cache_shard *shard, cache_block *block_ptr);
+static void heap_remove(cache_shard *shard, cache_block *block_ptr);
+static void heap_swap(cache_shard *shard, int i, int j);
+static void heap_sift_up(cache_shard *shard, int idx);
+static void heap_sift_down(cache_shard *shard, int idx);
+static void gdsf_update(cache_shard *shard, cache_block *block_ptr);
+static cache_block *gdsf_eviction(cache_shard *shard, unsigned int len);
 
 /* Functions */
 
 /*
  * init_cache: Initialize the cache for proxy use. User can specify the
- *      cache size and maximum object size.
+ *      cache size, maximum object size, the number of shards and the
+ *      eviction policy (CACHE_LRU, CACHE_CLOCK or CACHE_GDSF, optionally
+ *      OR'ed with CACHE_ADMIT_TINYLFU). The cache size is divided equally
+ *      among the shards. The number of shards is reduced if needed so that
+ *      every shard can hold the biggest object. default_ttl is kept for the
+ *      callers, for responses without freshness of their own.
  */
 proxy_cache 
-*init_cache(int max_cache_size, int input_max_object_size) {
+*init_cache(int max_cache_size, int input_max_object_size, int shard_count,
+int policy, int default_ttl) {
+    cache_shard *shard;
+    int i;
+    
     /* Allocate space */
     proxy_cache *my_cache = (proxy_cache *)Malloc(sizeof (proxy_cache));
     
@@ -44,101 +106,268 @@ proxy_cache
         return NULL;
     }
     
+    /* Check number of shards */
+    if (shard_count > max_cache_size / input_max_object_size) {
+        shard_count = max_cache_size / input_max_object_size;
+    }
+    if (shard_count < 1) {
+        shard_count = 1;
+    }
+    
     /* Init the variables */
-    my_cache->space = max_cache_size;
     my_cache->max_object_size = input_max_object_size;
-    my_cache->root = NULL;
+    my_cache->policy = policy & CACHE_POLICY_MASK;
+    my_cache->admission = policy & CACHE_ADMIT_TINYLFU;
+    my_cache->shard_count = shard_count;
+    my_cache->default_ttl = default_ttl;
+    my_cache->shards = 
+    (cache_shard *)Malloc(shard_count * sizeof(cache_shard));
+    
+    if (my_cache->shards == NULL) {
+        Free(my_cache);
+        return NULL;
+    }
+    
+    /* Arena for the blocks */
+    my_cache->arena = 
+    init_slab_arena((size_t)max_cache_size * CACHE_ARENA_FACTOR);
+    
+    if (my_cache->arena == NULL) {
+        Free(my_cache->shards);
+        Free(my_cache);
+        return NULL;
+    }
     
-    /* Init semaphores */
-    my_cache->readcnt = 0;
-    Sem_init(&my_cache->mutex_read, 0, 1);
-    Sem_init(&my_cache->mutex_write, 0, 1);
+    for (i = 0; i < shard_count; i++) {
+        shard = &my_cache->shards[i];
+        
+        shard->space = max_cache_size / shard_count;
+        shard->capacity = shard->space;
+        shard->root = NULL;
+        shard->tail = NULL;
+        shard->clock_hand = NULL;
+        
+        /* Init frequency sketch (all counters zero) if needed */
+        shard->sketch = NULL;
+        if (my_cache->admission) {
+            shard->sketch = (cache_sketch *)Calloc(1, sizeof(cache_sketch));
+        }
+        
+        /* Init GDSF heap if needed */
+        shard->heap = NULL;
+        shard->heap_size = 0;
+        shard->heap_capacity = 0;
+        shard->inflation = 0.0;
+        if (my_cache->policy == CACHE_GDSF) {
+            shard->heap = (cache_block **)Malloc(GDSF_INIT_HEAP * 
+            sizeof(cache_block *));
+            shard->heap_capacity = GDSF_INIT_HEAP;
+        }
+        
+        memset(&shard->stats, 0, sizeof(cache_stats));
+        
+        /* Init hash index, start with one table and no rehash */
+        if ((my_cache->admission && shard->sketch == NULL) || 
+        (my_cache->policy == CACHE_GDSF && shard->heap == NULL) || 
+        table_init(&shard->table[0], CACHE_INIT_BUCKETS) < 0) {
+            Free(shard->sketch);
+            Free(shard->heap);
+            while (--i >= 0) {
+                Free(my_cache->shards[i].table[0].buckets);
+                Free(my_cache->shards[i].sketch);
+                Free(my_cache->shards[i].heap);
+            }
+            Free(my_cache->arena);
+            Free(my_cache->shards);
+            Free(my_cache);
+            return NULL;
+        }
+        shard->table[1].buckets = NULL;
+        shard->table[1].size = 0;
+        shard->table[1].used = 0;
+        shard->rehash_idx = -1;
+        
+        /* Init semaphores */
+        shard->readcnt = 0;
+        Sem_init(&shard->mutex_read, 0, 1);
+        Sem_init(&shard->mutex_write, 0, 1);
+    }
     
     return my_cache;
 }
 
 /*
  * create_block: Accquire memory space for content that will be stored
- *      in the cache.
+ *      in the cache. The header, host, uri, validators and payload are
+ *      packed in one chunk from the arena. An empty validator is NULL.
  * 
  * return block pointer if success, NULL if not enough sapce
  */
 cache_block 
-*create_block(char *input_host, char *input_uri, void *buffer, int size) {
+*create_block(slab_arena *arena, unsigned int hash, char *input_host, 
+char *input_uri, void *buffer, int size, char *etag, char *last_modified) {
+    size_t host_len = strlen(input_host) + 1;
+    size_t uri_len = strlen(input_uri) + 1;
+    size_t etag_len = (etag != NULL && *etag != '\0') ? strlen(etag) + 1 : 0;
+    size_t modified_len = (last_modified != NULL && *last_modified != '\0') ? 
+    strlen(last_modified) + 1 : 0;
+    size_t total = block_size(input_host, input_uri, etag, last_modified, 
+    size);
+    slab_class *class_ptr;
+    
     /* Allocate space */
-    cache_block *block_ptr = (cache_block *)Malloc(sizeof(cache_block));
+    cache_block *block_ptr = (cache_block *)slab_alloc(arena, total, 
+    &class_ptr);
     
     /* If memory is full, return NULL*/
     if (block_ptr == NULL) {
         return NULL;
     }
+    block_ptr->slab_class = class_ptr;
+    block_ptr->charge = slab_chunk_size(arena, total);
     
-    /* Primary key initialization */
-    block_ptr->host = (char *)Malloc((strlen(input_host)+1) * sizeof(char));
-    block_ptr->uri = (char *)Malloc((strlen(input_uri)+1) * sizeof(char));
+    /* Primary key initialization, keys follow the header */
+    block_ptr->host = (char *)(block_ptr + 1);
+    block_ptr->uri = block_ptr->host + host_len;
     
-    /* If memory is full, return NULL */
-    if (block_ptr->host == NULL || block_ptr->uri == NULL) {
-        return NULL;
-    }
+    memcpy(block_ptr->host, input_host, host_len);
+    memcpy(block_ptr->uri, input_uri, uri_len);
+    
+    /* Validators follow the keys */
+    block_ptr->etag = copy_validator(block_ptr->uri + uri_len, etag, 
+    etag_len);
+    block_ptr->last_modified = copy_validator(block_ptr->uri + uri_len + 
+    etag_len, last_modified, modified_len);
+    
+    /* Initialization for hash index */
+    block_ptr->hash = hash;
+    block_ptr->next_hash_block = NULL;
+    
+    /* Never stale until store_block() sets the time */
+    block_ptr->expires = 0;
     
-    strcpy(block_ptr->host, input_host);
-    strcpy(block_ptr->uri, input_uri);
+    /* The cache holds the first reference */
+    block_ptr->refcnt = 1;
+    block_ptr->evicted = 0;
+    block_ptr->referenced = 0;
+    block_ptr->frequency = 1;
+    block_ptr->heap_index = -1;
+    block_ptr->priority = 0.0;
     
     /* Initialization for linked list */
     block_ptr->next_cache_block = NULL;
     block_ptr->prev_cache_block = NULL;
+    block_ptr->fill = NULL;
     
-    /* Payload initialization */
+    /* Payload initialization, payload follows the validators */
     block_ptr->payload_size = size;
-    block_ptr->payload = (void *)Malloc((size) * sizeof(char));
+    block_ptr->payload = (void *)(block_ptr->uri + uri_len + etag_len + 
+    modified_len);
     
-    /* If memory is full, return NULL */
-    if (block_ptr->payload == NULL) {
+    if (size > 0) {
+        memcpy((void *)(block_ptr->payload), (void *)buffer, size);
+    }
+    
+    return block_ptr;
+}
+
+/*
+ * block_size: Bytes of the chunk create_block() takes for a block with
+ *      these keys, validators and size bytes of payload
+ */
+size_t 
+block_size(char *input_host, char *input_uri, char *etag, 
+char *last_modified, int size) {
+    size_t len = sizeof(cache_block) + strlen(input_host) + 1 + 
+    strlen(input_uri) + 1 + size;
+    
+    if (etag != NULL && *etag != '\0') {
+        len += strlen(etag) + 1;
+    }
+    if (last_modified != NULL && *last_modified != '\0') {
+        len += strlen(last_modified) + 1;
+    }
+    return len;
+}
+
+/*
+ * create_fill_block: Create the placeholder of an in-flight fetch. It has no
+ *      payload, only the keys and the fill state. At most limit bytes can
+ *      be appended to it.
+ * 
+ * return block pointer if success, NULL if not enough sapce
+ */
+cache_block 
+*create_fill_block(slab_arena *arena, unsigned int hash, char *input_host, 
+char *input_uri, int limit) {
+    cache_block *block_ptr;
+    cache_fill *fill_ptr;
+    
+    if ((fill_ptr = (cache_fill *)Malloc(sizeof(cache_fill))) == NULL) {
+        return NULL;
+    }
+    
+    block_ptr = create_block(arena, hash, input_host, input_uri, NULL, 0, 
+    NULL, NULL);
+    if (block_ptr == NULL) {
+        Free(fill_ptr);
         return NULL;
     }
     
-    memcpy((void *)(block_ptr->payload), (void *)buffer, size);
+    fill_ptr->state = FILL_PENDING;
+    fill_ptr->waiters = 0;
+    fill_ptr->data = NULL;
+    fill_ptr->length = 0;
+    fill_ptr->capacity = 0;
+    fill_ptr->limit = limit;
+    fill_ptr->held = 0;
+    Sem_init(&fill_ptr->mutex, 0, 1);
+    Sem_init(&fill_ptr->wait, 0, 0);
+    block_ptr->fill = fill_ptr;
     
     return block_ptr;
 }
 
 /*
  * free_block: Free the memory space accquired by the block for future use.
- * 
+ *      The whole chunk goes back to the arena.
  */
 void 
 free_block(struct cache_block *block_ptr) {
-    Free(block_ptr->host);
-    Free(block_ptr->uri);
-    Free(block_ptr->payload);
-    Free(block_ptr);
+    if (block_ptr->fill != NULL) {
+        if (block_ptr->fill->data != NULL) {
+            Free(block_ptr->fill->data);
+        }
+        Free(block_ptr->fill);
+    }
+    slab_free(block_ptr->slab_class, block_ptr);
 }
 
 /*
  * insert_block: Put block into linked list and update the space
  */
 void 
-insert_block(proxy_cache *my_cache, cache_block *block_ptr) {
+insert_block(cache_shard *shard, cache_block *block_ptr) {
     
-    if (my_cache->root == NULL) { /* There is no block in the list */
+    if (shard->root == NULL) { /* There is no block in the list */
         /* Set block_ptr as cache's root and initialize the list */
-        my_cache->root = block_ptr;
+        shard->root = block_ptr;
+        shard->tail = block_ptr;
         block_ptr->next_cache_block = NULL;
         block_ptr->prev_cache_block = NULL;
     }
     else {
         /* Connect with the current root */
         block_ptr->prev_cache_block = NULL;
-        block_ptr->next_cache_block = my_cache->root;
-        my_cache->root->prev_cache_block = block_ptr;
+        block_ptr->next_cache_block = shard->root;
+        shard->root->prev_cache_block = block_ptr;
         
         /* Set block_ptr as cache's root */
-        my_cache->root = block_ptr;
+        shard->root = block_ptr;
     }
     
     /* Update remaining space */
-    my_cache->space -= block_ptr->payload_size;
+    shard->space -= block_ptr->charge;
 }
 
 /*
@@ -146,11 +375,11 @@ insert_block(proxy_cache *my_cache, cache_block *block_ptr) {
  * 
  */
 void 
-remove_block(proxy_cache *my_cache, cache_block *block_ptr) {
+remove_block(cache_shard *shard, cache_block *block_ptr) {
     
     /* Check if there is previous block (this node is root)*/
     if (block_ptr->prev_cache_block == NULL) {
-        my_cache->root = block_ptr->next_cache_block;
+        shard->root = block_ptr->next_cache_block;
     }
     else {
         block_ptr->prev_cache_block->next_cache_block = 
@@ -162,32 +391,216 @@ remove_block(proxy_cache *my_cache, cache_block *block_ptr) {
         block_ptr->next_cache_block->prev_cache_block = 
         block_ptr->prev_cache_block;
     }
+    else { /* This node is tail */
+        shard->tail = block_ptr->prev_cache_block;
+    }
+    
+    /* Move the clock hand off this block (NULL wraps it to the tail) */
+    if (shard->clock_hand == block_ptr) {
+        shard->clock_hand = block_ptr->prev_cache_block;
+    }
     
     /* Update remaining space */
-    my_cache->space += block_ptr->payload_size;
+    shard->space += block_ptr->charge;
 }
 
 /*
  * search_block: Return the pointer of the block that has the content of the
- *      request host and port from client.
+ *      request host and port from client. Only the bucket of the hash is
+ *      scanned (in both tables while rehashing).
  */
 cache_block 
-*search_block(proxy_cache *my_cache, char *input_host, char* input_uri) {
+*search_block(cache_shard *shard, unsigned int hash, 
+char *input_host, char* input_uri) {
     cache_block *block_ptr;
+    cache_table *table;
+    int i;
     
-    for (block_ptr = my_cache->root; block_ptr != NULL; block_ptr = 
-    block_ptr->next_cache_block) {
+    for (i = 0; i < 2; i++) {
+        table = &shard->table[i];
         
-        if (!strcmp(block_ptr->host, input_host) && 
-        !strcmp(block_ptr->uri, input_uri)) {
-            return block_ptr;
+        /* table[1] is empty when not rehashing */
+        if (table->size == 0) {
+            break;
         }
         
+        for (block_ptr = table->buckets[hash & (table->size - 1)]; 
+        block_ptr != NULL; block_ptr = block_ptr->next_hash_block) {
+            
+            if (block_ptr->hash == hash && 
+            !strcmp(block_ptr->host, input_host) && 
+            !strcmp(block_ptr->uri, input_uri)) {
+                return block_ptr;
+            }
+        }
     }
     
     return NULL;
 }
 
+/*
+ * hash_key: FNV-1a hash of host and uri. A 0 byte separates the two strings
+ *      so that "ab" + "c" and "a" + "bc" do not collide.
+ */
+unsigned int 
+hash_key(char *input_host, char *input_uri) {
+    unsigned int hash = 2166136261u;
+    unsigned char *p;
+    
+    for (p = (unsigned char *)input_host; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = hash * 16777619u; /* separator */
+    for (p = (unsigned char *)input_uri; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    
+    return hash;
+}
+
+/*
+ * get_shard: Return the shard that owns the hash. The hash is mixed again
+ *      so that the shard does not depend on the low bits used for buckets.
+ */
+cache_shard 
+*get_shard(proxy_cache *my_cache, unsigned int hash) {
+    return &my_cache->shards[((hash * 2654435761u) >> 16) % 
+    my_cache->shard_count];
+}
+
+/*
+ * table_init: Allocate the empty buckets of hash table
+ * 
+ * return 0 if success, -1 if not enough space
+ */
+int 
+table_init(cache_table *table, unsigned int size) {
+    table->buckets = (cache_block **)Calloc(size, sizeof(cache_block *));
+    
+    if (table->buckets == NULL) {
+        return -1;
+    }
+    
+    table->size = size;
+    table->used = 0;
+    return 0;
+}
+
+/*
+ * table_insert: Put block into hash index. When the table is full, start
+ *      rehashing into a table of double size. New blocks always go to the
+ *      newest table so table[0] only shrinks during rehash.
+ */
+void 
+table_insert(cache_shard *shard, cache_block *block_ptr) {
+    cache_table *table;
+    unsigned int idx;
+    
+    /* Grow when load factor reaches 1 (keep old table if no memory) */
+    if (shard->rehash_idx == -1 && 
+    shard->table[0].used >= shard->table[0].size) {
+        if (table_init(&shard->table[1], 
+        shard->table[0].size * 2) == 0) {
+            shard->rehash_idx = 0;
+        }
+    }
+    
+    if (shard->rehash_idx == -1) {
+        table = &shard->table[0];
+    }
+    else {
+        table = &shard->table[1];
+    }
+    
+    /* Push at the head of the bucket */
+    idx = block_ptr->hash & (table->size - 1);
+    block_ptr->next_hash_block = table->buckets[idx];
+    table->buckets[idx] = block_ptr;
+    table->used += 1;
+}
+
+/*
+ * table_remove: Take the block out of hash index (whichever table has it)
+ */
+void 
+table_remove(cache_shard *shard, cache_block *block_ptr) {
+    if (!table_unlink(&shard->table[0], block_ptr) && 
+    shard->rehash_idx != -1) {
+        table_unlink(&shard->table[1], block_ptr);
+    }
+}
+
+/*
+ * table_unlink: Unlink block from its bucket of the given table
+ * 
+ * return 1 if found, 0 if the block is not in this table
+ */
+int 
+table_unlink(cache_table *table, cache_block *block_ptr) {
+    cache_block **link_ptr;
+    
+    for (link_ptr = &table->buckets[block_ptr->hash & (table->size - 1)]; 
+    *link_ptr != NULL; link_ptr = &(*link_ptr)->next_hash_block) {
+        
+        if (*link_ptr == block_ptr) {
+            *link_ptr = block_ptr->next_hash_block;
+            block_ptr->next_hash_block = NULL;
+            table->used -= 1;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * rehash_step: Move a few buckets from table[0] to table[1]. When every
+ *      bucket is moved, table[1] becomes table[0] and rehash is done. Must
+ *      be called with write permission.
+ */
+void 
+rehash_step(cache_shard *shard, int steps) {
+    cache_table *old_table = &shard->table[0];
+    cache_table *new_table = &shard->table[1];
+    cache_block *block_ptr, *next_ptr;
+    unsigned int idx;
+    
+    if (shard->rehash_idx == -1) {
+        return;
+    }
+    
+    while (steps > 0 && shard->rehash_idx < old_table->size) {
+        block_ptr = old_table->buckets[shard->rehash_idx];
+        
+        /* Move every block of this bucket */
+        while (block_ptr != NULL) {
+            next_ptr = block_ptr->next_hash_block;
+            
+            idx = block_ptr->hash & (new_table->size - 1);
+            block_ptr->next_hash_block = new_table->buckets[idx];
+            new_table->buckets[idx] = block_ptr;
+            old_table->used -= 1;
+            new_table->used += 1;
+            
+            block_ptr = next_ptr;
+        }
+        
+        old_table->buckets[shard->rehash_idx] = NULL;
+        shard->rehash_idx += 1;
+        steps -= 1;
+    }
+    
+    /* Done, switch to the new table */
+    if (shard->rehash_idx == old_table->size) {
+        Free(old_table->buckets);
+        *old_table = *new_table;
+        new_table->buckets = NULL;
+        new_table->size = 0;
+        new_table->used = 0;
+        shard->rehash_idx = -1;
+    }
+}
+
 /*
  * read_cache_block: Extract the payload to buffer, check for false request
  * 
@@ -208,20 +621,93 @@ read_cache_block(cache_block *block_ptr, void *buffer) {
     return block_ptr->payload_size;
 }
 
+/*
+ * read_lock: Readers enter the cache, the first reader locks the write flag
+ */
+void 
+read_lock(cache_shard *shard) {
+    P(&shard->mutex_read);
+    shard->readcnt += 1;
+    if (shard->readcnt == 1) { /* First reader locks the write flag */
+        P(&shard->mutex_write);
+    }
+    V(&shard->mutex_read);
+}
+
+/*
+ * read_unlock: Readers leave the cache, the last reader unlocks the write flag
+ */
+void 
+read_unlock(cache_shard *shard) {
+    P(&shard->mutex_read);
+    shard->readcnt -= 1;
+    if (shard->readcnt == 0) { /* Last reader unlocks write flag */
+        V(&shard->mutex_write);
+    }
+    V(&shard->mutex_read);
+}
+
+/*
+ * release_block: Drop one reference of the block, free the block when the
+ *      last reference is dropped.
+ */
+void 
+release_block(cache_block *block_ptr) {
+    if (__sync_sub_and_fetch(&block_ptr->refcnt, 1) == 0) {
+        free_block(block_ptr);
+    }
+}
+
+/*
+ * cache_now: Coarse monotonic clock in seconds, cheap enough for every hit
+ */
+unsigned long 
+cache_now(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long)ts.tv_sec;
+}
+
+/*
+ * copy_validator: Copy validator (len bytes with the '\0') to dst
+ * 
+ * return dst, NULL if len is 0
+ */
+char 
+*copy_validator(char *dst, char *validator, size_t len) {
+    if (len == 0) {
+        return NULL;
+    }
+    memcpy(dst, validator, len);
+    return dst;
+}
+
+/*
+ * block_expired: Tell if a cached block is stale
+ */
+int 
+block_expired(cache_block *block_ptr) {
+    return block_ptr->expires != 0 && block_ptr->expires <= cache_now();
+}
+
 /*
  * lru_update: Put the most recently
  *      used block at the beginning of the linked list (with synchroniztion).
- * 
+ *      The block may be evicted between the lookup and here, in that case it
+ *      is no longer in the list and there is nothing to update.
  */
-void
-lru_update(proxy_cache *my_cache, cache_block *block_ptr) {
+void 
+lru_update(cache_shard *shard, cache_block *block_ptr) {
     
     /* Rearrange the linked list (take out and re-insert as root) */
-    P(&my_cache->mutex_write); /* Need wrtie permission */
-    remove_block(my_cache, block_ptr);
-    insert_block(my_cache, block_ptr);
-    V(&my_cache->mutex_write);
-
+    P(&shard->mutex_write); /* Need wrtie permission */
+    if (!block_ptr->evicted) {
+        remove_block(shard, block_ptr);
+        insert_block(shard, block_ptr);
+    }
+    V(&shard->mutex_write);
+    
 }
 
 /*
@@ -229,140 +715,1010 @@ lru_update(proxy_cache *my_cache, cache_block *block_ptr) {
  *      to our insert policy, the last block is always LRU block.
  */
 cache_block 
-*get_lru(proxy_cache *my_cache) {
-    cache_block *block_ptr;
+*get_lru(cache_shard *shard) {
+    return shard->tail;
+}
+
+/*
+ * eviction: Cut LRU blocks off the end of the linked list until there is
+ *      len bytes of space. All victims are taken in one pass from the tail
+ *      and the list is cut once. Must be called with write permission.
+ * 
+ * return the victims chained by next_cache_block (NULL if no victim), the
+ *      caller releases them with release_victims() after releasing write
+ *      permission
+ */
+cache_block 
+*eviction(cache_shard *shard, unsigned int len) {
+    cache_block *lru_block, *first_victim = NULL;
+    
+    /* Walk backward from the tail and take each victim out of the index */
+    for (lru_block = get_lru(shard); 
+    lru_block != NULL && shard->space < len; 
+    lru_block = lru_block->prev_cache_block) {
+        table_remove(shard, lru_block);
+        shard->space += lru_block->charge;
+        lru_block->evicted = 1;
+        first_victim = lru_block;
+    }
     
-    /* If the cache is empy, just return */
-    if ((block_ptr = my_cache->root) == NULL) {
+    if (first_victim == NULL) {
         return NULL;
     }
     
-    /* LRU block is last block in the linked list (LRU->next = NULL)*/
-    while (block_ptr->next_cache_block != NULL) {
-        block_ptr = block_ptr->next_cache_block;
+    /* Cut the list before the first victim */
+    if (first_victim->prev_cache_block == NULL) {
+        shard->root = NULL;
+    }
+    else {
+        first_victim->prev_cache_block->next_cache_block = NULL;
     }
+    shard->tail = first_victim->prev_cache_block;
+    first_victim->prev_cache_block = NULL;
     
-    return block_ptr;
+    return first_victim;
 }
 
 /*
- * eviction: Remove the last block in the linked list 
- *      and free the memory space
+ * clock_eviction: Move the clock hand from the tail toward the root until
+ *      there is len bytes of space. Referenced blocks get a second chance
+ *      (bit cleared, hand moves on), the other blocks are evicted. The hand
+ *      passes every block at most twice. Must be called with write
+ *      permission.
  * 
+ * return the victims chained by next_cache_block like eviction()
  */
-void 
-eviction(proxy_cache *my_cache) {
-    cache_block *lru_block;
-    lru_block = get_lru(my_cache);
-    remove_block(my_cache, lru_block);
-    free_block(lru_block);
+cache_block 
+*clock_eviction(cache_shard *shard, unsigned int len) {
+    cache_block *hand_ptr, *victim_ptr = NULL;
+    
+    while (shard->space < len && shard->tail != NULL) {
+        hand_ptr = (shard->clock_hand != NULL) ? shard->clock_hand : 
+        shard->tail;
+        
+        if (__atomic_load_n(&hand_ptr->referenced, __ATOMIC_RELAXED)) {
+            /* Second chance */
+            __atomic_store_n(&hand_ptr->referenced, 0, __ATOMIC_RELAXED);
+            shard->clock_hand = hand_ptr->prev_cache_block;
+            continue;
+        }
+        
+        /* Evict, remove_block() moves the hand to the previous block */
+        table_remove(shard, hand_ptr);
+        remove_block(shard, hand_ptr);
+        hand_ptr->evicted = 1;
+        
+        hand_ptr->prev_cache_block = NULL;
+        hand_ptr->next_cache_block = victim_ptr;
+        victim_ptr = hand_ptr;
+    }
+    
+    return victim_ptr;
 }
 
 /*
- * read_cache: Search cache by using host and uri as primary key. If the block
- *      is found, copy the block content to the buffer then rearrange the
- *      linked list to maintain LRU order. Many readers may read the block at
- *      the same time but only 1 can move or delete block. Thus, rearrange
- *      cache list is considered as write operation and need to wait for write
- *      permission.
- * 
- * return payload length = hit, -1 = miss
+ * sketch_index: Counter index of the hash in the given row. Rows use
+ *      different odd multipliers so a collision in one row is unlikely to
+ *      be a collision in the others.
  */
-int 
-read_cache(proxy_cache *my_cache, 
-char *input_host, char *input_uri, void *buffer) {
-    int read_len;
-    cache_block *block_ptr;
+unsigned int 
+sketch_index(unsigned int hash, int row) {
+    static const unsigned int seed[SKETCH_DEPTH] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+    unsigned int h = hash * seed[row];
     
-    /* Can't read if no cahce */
-    if (my_cache == NULL) {
-        return -1;
-    }
+    return (h ^ (h >> 16)) & (SKETCH_WIDTH - 1);
+}
+
+/*
+ * sketch_increment: Count one lookup of the hash. Counters saturate at
+ *      SKETCH_MAX_COUNT. Called without locks, a racing increment may be
+ *      lost which only makes the estimate slightly lower.
+ */
+void 
+sketch_increment(cache_sketch *sketch, unsigned int hash) {
+    unsigned char *count_ptr;
+    int row;
     
-    /* Semaphores */
-    P(&my_cache->mutex_read);
-    my_cache->readcnt += 1;
-    if (my_cache->readcnt == 1) { /* First reader locks the write flag */
-        P(&my_cache->mutex_write);
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        count_ptr = &sketch->count[row][sketch_index(hash, row)];
+        if (*count_ptr < SKETCH_MAX_COUNT) {
+            *count_ptr += 1;
+        }
     }
-    V(&my_cache->mutex_read);
     
-    if ((block_ptr = search_block(my_cache, input_host, input_uri)) == NULL) {
-    /* Cache Miss */
-        
-        /* Semaphores */
-        P(&my_cache->mutex_read);
-        my_cache->readcnt -= 1;
-        if (my_cache->readcnt == 0) { /* First reader locks write flag */
-            V(&my_cache->mutex_write);
+    __sync_add_and_fetch(&sketch->additions, 1);
+}
+
+/*
+ * sketch_frequency: Estimated number of lookups of the hash (the minimum
+ *      counter over all rows).
+ */
+int 
+sketch_frequency(cache_sketch *sketch, unsigned int hash) {
+    int row, count, frequency = SKETCH_MAX_COUNT;
+    
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        count = sketch->count[row][sketch_index(hash, row)];
+        if (count < frequency) {
+            frequency = count;
         }
-        V(&my_cache->mutex_read);
-        
-        return -1;
     }
     
-    /* read to buffer */
-    read_len = read_cache_block(block_ptr, buffer);
+    return frequency;
+}
+
+/*
+ * sketch_age: Halve every counter so the sketch follows recent popularity.
+ *      Called by writer once SKETCH_SAMPLE lookups are recorded.
+ */
+void 
+sketch_age(cache_sketch *sketch) {
+    int row, col;
     
-    /* Semaphores */
-    P(&my_cache->mutex_read);
-    my_cache->readcnt -= 1;
-    if (my_cache->readcnt == 0) { /* Last reader unlocks write flag */
-        V(&my_cache->mutex_write);
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        for (col = 0; col < SKETCH_WIDTH; col++) {
+            sketch->count[row][col] >>= 1;
+        }
     }
-    V(&my_cache->mutex_read);
     
-    /* Update LRU order */
-    lru_update(my_cache, block_ptr);
-    
-    return read_len;
+    sketch->additions = 0;
 }
 
 /*
- * write_cache: Write the content to the cache with synchronization.
- *      Only 1 writer is allowed to write cache at a time.
+ * admit_block: TinyLFU admission. If the shard has to evict to make room,
+ *      compare the lookup frequency of the new object with the block that
+ *      would be evicted first (LRU tail or the block under the clock hand).
+ *      Must be called with write permission.
  * 
- * return 1 = success, -1 = error
+ * return 1 = admit, 0 = reject
  */
 int 
-write_cache(proxy_cache *my_cache, 
-char *input_host, char *input_uri, void *buffer, int len) {
-    cache_block *block_ptr;
+admit_block(proxy_cache *my_cache, cache_shard *shard, unsigned int hash) {
+    cache_block *victim_ptr;
     
-    /* Ignore spurious request */
-    if (my_cache == NULL) {
-        return -1;
+    if (!my_cache->admission) {
+        return 1;
     }
     
-    /* Check length validity */
-    if (len > my_cache->max_object_size) {
-        return -1;
+    /* Aging */
+    if (shard->sketch->additions >= SKETCH_SAMPLE) {
+        sketch_age(shard->sketch);
     }
     
-    /* Semaphores: Lock write permission*/
-    P(&my_cache->mutex_write);
+    if (my_cache->policy == CACHE_CLOCK && shard->clock_hand != NULL) {
+        victim_ptr = shard->clock_hand;
+    }
+    else if (my_cache->policy == CACHE_GDSF) {
+        victim_ptr = (shard->heap_size > 0) ? shard->heap[0] : NULL;
+    }
+    else {
+        victim_ptr = shard->tail;
+    }
     
-    /* If there is not enough space, keep deleting LRU block */
-    while (my_cache->space < len) {
-        eviction(my_cache);
+    if (victim_ptr == NULL) {
+        return 1;
     }
     
-    /* Create the block and write the content */
-    block_ptr = create_block(input_host, input_uri, buffer, len);
+    /* Ties go to the new object to keep recency among equals */
+    return sketch_frequency(shard->sketch, hash) >= 
+    sketch_frequency(shard->sketch, victim_ptr->hash);
+}
+
+/*
+ * gdsf_priority: GreedyDual-Size-Frequency priority of the block
+ */
+double 
+gdsf_priority(cache_shard *shard, cache_block *block_ptr) {
+    int size = (block_ptr->payload_size > 0) ? block_ptr->payload_size : 1;
+    
+    return shard->inflation + block_ptr->frequency * GDSF_COST / size;
+}
+
+/*
+ * heap_reserve: Make sure the heap has room for one more block
+ * 
+ * return 0 if success, -1 if not enough space
+ */
+int 
+heap_reserve(cache_shard *shard) {
+    cache_block **new_heap;
     
-    /* Check for block validation */
-    if (block_ptr == NULL) {
-        /* Semaphores: Unlock write permission */
-        V(&my_cache->mutex_write);
-        return -1;
+    if (shard->heap_size < shard->heap_capacity) {
+        return 0;
     }
     
-    /* Insert to linked list */
-    insert_block(my_cache, block_ptr);
+    new_heap = (cache_block **)Realloc(shard->heap, 
+    2 * shard->heap_capacity * sizeof(cache_block *));
     
-    /* Semaphores: Unlock write permission */
-    V(&my_cache->mutex_write);
+    if (new_heap == NULL) {
+        return -1;
+    }
     
-    return 1;
+    shard->heap = new_heap;
+    shard->heap_capacity *= 2;
+    return 0;
 }
 
+/*
+ * heap_push: Put block into the heap, heap_reserve() must succeed first
+ */
+void 
+heap_push(cache_shard *shard, cache_block *block_ptr) {
+    block_ptr->heap_index = shard->heap_size;
+    shard->heap[shard->heap_size] = block_ptr;
+    shard->heap_size += 1;
+    heap_sift_up(shard, block_ptr->heap_index);
+}
+
+/*
+ * heap_remove: Take the block out of the heap
+ */
+void 
+heap_remove(cache_shard *shard, cache_block *block_ptr) {
+    int idx = block_ptr->heap_index;
+    
+    /* Fill the hole with the last block then fix its position */
+    shard->heap_size -= 1;
+    if (idx != shard->heap_size) {
+        heap_swap(shard, idx, shard->heap_size);
+        heap_sift_up(shard, idx);
+        heap_sift_down(shard, idx);
+    }
+    
+    block_ptr->heap_index = -1;
+}
+
+/*
+ * heap_swap: Swap 2 blocks in the heap and update their positions
+ */
+void 
+heap_swap(cache_shard *shard, int i, int j) {
+    cache_block *temp_ptr = shard->heap[i];
+    
+    shard->heap[i] = shard->heap[j];
+    shard->heap[j] = temp_ptr;
+    shard->heap[i]->heap_index = i;
+    shard->heap[j]->heap_index = j;
+}
+
+/*
+ * heap_sift_up: Move the block at idx up while it is lower than its parent
+ */
+void 
+heap_sift_up(cache_shard *shard, int idx) {
+    int parent;
+    
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (shard->heap[parent]->priority <= shard->heap[idx]->priority) {
+            break;
+        }
+        heap_swap(shard, parent, idx);
+        idx = parent;
+    }
+}
+
+/*
+ * heap_sift_down: Move the block at idx down while it is higher than one of
+ *      its children
+ */
+void 
+heap_sift_down(cache_shard *shard, int idx) {
+    int child;
+    
+    while ((child = 2 * idx + 1) < shard->heap_size) {
+        /* Pick the lower child */
+        if (child + 1 < shard->heap_size && 
+        shard->heap[child + 1]->priority < shard->heap[child]->priority) {
+            child += 1;
+        }
+        if (shard->heap[idx]->priority <= shard->heap[child]->priority) {
+            break;
+        }
+        heap_swap(shard, idx, child);
+        idx = child;
+    }
+}
+
+/*
+ * gdsf_update: Count a hit of the block and raise its priority (with
+ *      synchronization). Like lru_update(), the block may be evicted between
+ *      the lookup and here.
+ */
+void 
+gdsf_update(cache_shard *shard, cache_block *block_ptr) {
+    P(&shard->mutex_write);
+    if (!block_ptr->evicted) {
+        block_ptr->frequency += 1;
+        block_ptr->priority = gdsf_priority(shard, block_ptr);
+        heap_sift_down(shard, block_ptr->heap_index);
+    }
+    V(&shard->mutex_write);
+}
+
+/*
+ * gdsf_eviction: Evict the blocks with the lowest priority until there is
+ *      len bytes of space. Inflation is raised to the priority of each
+ *      victim. Must be called with write permission.
+ * 
+ * return the victims chained by next_cache_block like eviction()
+ */
+cache_block 
+*gdsf_eviction(cache_shard *shard, unsigned int len) {
+    cache_block *lowest_ptr, *victim_ptr = NULL;
+    
+    while (shard->space < len && shard->heap_size > 0) {
+        lowest_ptr = shard->heap[0];
+        shard->inflation = lowest_ptr->priority;
+        
+        heap_remove(shard, lowest_ptr);
+        table_remove(shard, lowest_ptr);
+        remove_block(shard, lowest_ptr);
+        lowest_ptr->evicted = 1;
+        
+        lowest_ptr->prev_cache_block = NULL;
+        lowest_ptr->next_cache_block = victim_ptr;
+        victim_ptr = lowest_ptr;
+    }
+    
+    return victim_ptr;
+}
+
+/*
+ * release_victims: Drop the cache reference of every block of the victim
+ *      chain returned by eviction(). Blocks that are still pinned are freed
+ *      later by their last unpin_cache().
+ */
+void 
+release_victims(cache_block *victim_ptr) {
+    cache_block *next_ptr;
+    
+    while (victim_ptr != NULL) {
+        next_ptr = victim_ptr->next_cache_block;
+        release_block(victim_ptr);
+        victim_ptr = next_ptr;
+    }
+}
+
+/*
+ * pin_block: Search the shard for the block and take a reference on it
+ *      while holding read permission, so it can't be freed under us.
+ * 
+ * return pinned block (may be a placeholder), NULL if not found
+ */
+cache_block 
+*pin_block(cache_shard *shard, unsigned int hash, 
+char *input_host, char *input_uri) {
+    cache_block *block_ptr;
+    
+    read_lock(shard);
+    
+    if ((block_ptr = search_block(shard, hash, 
+    input_host, input_uri)) != NULL) {
+        __sync_add_and_fetch(&block_ptr->refcnt, 1);
+    }
+    
+    read_unlock(shard);
+    
+    return block_ptr;
+}
+
+/*
+ * hit_update: Count the hit and update the eviction order of a pinned
+ *      block. LRU moves it to the root and GDSF raises its priority (both
+ *      need write permission), CLOCK only sets the referenced bit.
+ */
+void 
+hit_update(proxy_cache *my_cache, cache_shard *shard, cache_block *block_ptr) {
+    __sync_add_and_fetch(&shard->stats.hits, 1);
+    __sync_add_and_fetch(&shard->stats.hit_bytes, block_ptr->payload_size);
+    
+    if (my_cache->policy == CACHE_CLOCK) {
+        /* Hit only marks the block, no write needed */
+        if (!__atomic_load_n(&block_ptr->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&block_ptr->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else if (my_cache->policy == CACHE_GDSF) {
+        /* Update priority */
+        gdsf_update(shard, block_ptr);
+    }
+    else {
+        /* Update LRU order */
+        lru_update(shard, block_ptr);
+    }
+}
+
+/*
+ * unlink_block: Take a cached block out of the index, the list and the heap
+ *      and give its space back. The caller drops the cache reference later.
+ *      Must be called with write permission.
+ */
+void 
+unlink_block(proxy_cache *my_cache, cache_shard *shard, 
+cache_block *block_ptr) {
+    table_remove(shard, block_ptr);
+    if (my_cache->policy == CACHE_GDSF) {
+        heap_remove(shard, block_ptr);
+    }
+    remove_block(shard, block_ptr);
+    block_ptr->evicted = 1;
+}
+
+/*
+ * wake_fill: Wake every request sleeping on the fill. A reader registers
+ *      itself under the mutex before it sleeps, so we know how many times
+ *      to signal the semaphore and no wake up is lost. Must be called with
+ *      the fill mutex.
+ */
+void 
+wake_fill(cache_fill *state_ptr) {
+    while (state_ptr->waiters > 0) {
+        V(&state_ptr->wait);
+        state_ptr->waiters -= 1;
+    }
+}
+
+/*
+ * finish_fill: Set the final state of a placeholder, wake all its readers
+ *      and drop the references of the cache and of the filling request.
+ *      The placeholder must be out of the index already. Readers still
+ *      hold their own reference to finish reading the fill buffer.
+ */
+void 
+finish_fill(cache_block *fill_ptr, int state) {
+    cache_fill *state_ptr = fill_ptr->fill;
+    
+    P(&state_ptr->mutex);
+    state_ptr->state = state;
+    wake_fill(state_ptr);
+    V(&state_ptr->mutex);
+    
+    release_block(fill_ptr); /* Cache reference */
+    release_block(fill_ptr); /* Filling request reference */
+}
+
+/*
+ * read_cache: Search cache by using host and uri as primary key. If the block
+ *      is found, copy the block content to the buffer. This is a copying
+ *      version of pin_cache(), see below.
+ * 
+ * return payload length = hit, -1 = miss
+ */
+int 
+read_cache(proxy_cache *my_cache, 
+char *input_host, char *input_uri, void *buffer) {
+    int read_len;
+    cache_block *block_ptr;
+    
+    if ((block_ptr = pin_cache(my_cache, input_host, input_uri)) == NULL) {
+        return -1;
+    }
+    
+    /* read to buffer */
+    read_len = read_cache_block(block_ptr, buffer);
+    unpin_cache(my_cache, block_ptr);
+    
+    return read_len;
+}
+
+/*
+ * pin_cache: Search cache by using host and uri as primary key. If the block
+ *      is found, take a reference on it then rearrange the linked list of
+ *      its shard to maintain LRU order (GDSF fixes the heap instead, CLOCK
+ *      only sets the referenced bit and does not need write permission).
+ *      Many readers may read the block at the same time but only 1 can move
+ *      or delete block. Thus, rearrange cache list is considered as write
+ *      operation and need to wait for write permission.
+ *      The caller reads payload and payload_size of the returned block
+ *      directly and must call unpin_cache() when done. An object that is
+ *      still being fetched counts as a miss here, see lookup_cache().
+ * 
+ * return pinned block = hit, NULL = miss
+ */
+cache_block 
+*pin_cache(proxy_cache *my_cache, char *input_host, char *input_uri) {
+    unsigned int hash;
+    cache_shard *shard;
+    cache_block *block_ptr;
+    
+    /* Can't read if no cahce */
+    if (my_cache == NULL) {
+        return NULL;
+    }
+    
+    /* Hash outside of the critical section */
+    hash = hash_key(input_host, input_uri);
+    shard = get_shard(my_cache, hash);
+    
+    /* Every lookup counts toward the frequency for admission */
+    if (my_cache->admission) {
+        sketch_increment(shard->sketch, hash);
+    }
+    __sync_add_and_fetch(&shard->stats.lookups, 1);
+    
+    if ((block_ptr = pin_block(shard, hash, input_host, input_uri)) == NULL) {
+        return NULL; /* Cache Miss */
+    }
+    
+    if (block_ptr->fill != NULL || block_expired(block_ptr)) {
+        /* Placeholder, or stale and replaced when it's written again */
+        release_block(block_ptr);
+        return NULL;
+    }
+    
+    hit_update(my_cache, shard, block_ptr);
+    
+    return block_ptr;
+}
+
+/*
+ * unpin_cache: Drop the reference taken by pin_cache(). The payload must not
+ *      be used after this call.
+ */
+void 
+unpin_cache(proxy_cache *my_cache, cache_block *block_ptr) {
+    if (my_cache == NULL || block_ptr == NULL) {
+        return;
+    }
+    
+    release_block(block_ptr);
+}
+
+/*
+ * lookup_cache: pin_cache() with collapsed forwarding. On a miss the first
+ *      request puts a placeholder in the index (with write permission, the
+ *      index is checked again first) and becomes the one who fetches.
+ *      Requests that find a placeholder read the response from it while it
+ *      is being fetched.
+ * 
+ *      A stale block is taken out of the cache, or handed out for
+ *      revalidation if it has validators.
+ * 
+ * return CACHE_HIT (*block_ptr is pinned, unpin_cache() when done),
+ *      CACHE_FILL (*block_ptr is the placeholder, the caller must end it
+ *      with fill_cache() or abort_fill()), CACHE_STREAM (*block_ptr is a
+ *      pinned placeholder, read_fill() then unpin_cache()),
+ *      CACHE_REVALIDATE (*block_ptr is the pinned stale block, fetch it
+ *      with a conditional request, then refresh_cache() if it's still good,
+ *      unpin_cache() when done) or CACHE_MISS
+ */
+int 
+lookup_cache(proxy_cache *my_cache, char *input_host, char *input_uri, 
+cache_block **block_ptr) {
+    unsigned int hash;
+    cache_shard *shard;
+    cache_block *found_ptr;
+    cache_block *stale_ptr = NULL;
+    
+    *block_ptr = NULL;
+    
+    /* Can't read if no cahce */
+    if (my_cache == NULL) {
+        return CACHE_MISS;
+    }
+    
+    /* Hash outside of the critical section */
+    hash = hash_key(input_host, input_uri);
+    shard = get_shard(my_cache, hash);
+    
+    /* Every lookup counts toward the frequency for admission */
+    if (my_cache->admission) {
+        sketch_increment(shard->sketch, hash);
+    }
+    __sync_add_and_fetch(&shard->stats.lookups, 1);
+    
+    /* A stale block is a miss, unless the server can tell it's still good */
+    found_ptr = pin_block(shard, hash, input_host, input_uri);
+    if (found_ptr != NULL && block_expired(found_ptr)) {
+        __sync_add_and_fetch(&shard->stats.expired, 1);
+        if (found_ptr->etag != NULL || found_ptr->last_modified != NULL) {
+            *block_ptr = found_ptr;
+            return CACHE_REVALIDATE;
+        }
+        release_block(found_ptr);
+        found_ptr = NULL;
+    }
+    
+    if (found_ptr == NULL) {
+        /* Cache Miss, fetch it unless another request started first */
+        P(&shard->mutex_write);
+        
+        /* Take the stale block out, it is released outside the lock */
+        found_ptr = search_block(shard, hash, input_host, input_uri);
+        if (found_ptr != NULL && block_expired(found_ptr)) {
+            unlink_block(my_cache, shard, found_ptr);
+            stale_ptr = found_ptr;
+            found_ptr = NULL;
+        }
+        
+        if (found_ptr != NULL) {
+            __sync_add_and_fetch(&found_ptr->refcnt, 1);
+        }
+        else if ((found_ptr = create_fill_block(my_cache->arena, hash, 
+        input_host, input_uri, my_cache->max_object_size)) != NULL) {
+            /* References of the cache and of the caller */
+            found_ptr->refcnt = 2;
+            table_insert(shard, found_ptr);
+            V(&shard->mutex_write);
+            
+            if (stale_ptr != NULL) {
+                release_block(stale_ptr);
+            }
+            *block_ptr = found_ptr;
+            return CACHE_FILL;
+        }
+        
+        V(&shard->mutex_write);
+        
+        if (stale_ptr != NULL) {
+            release_block(stale_ptr);
+        }
+        if (found_ptr == NULL) {
+            return CACHE_MISS;
+        }
+    }
+    
+    *block_ptr = found_ptr;
+    
+    /* Another request is fetching the object, the bytes are counted as
+     * they are read */
+    if (found_ptr->fill != NULL) {
+        __sync_add_and_fetch(&shard->stats.hits, 1);
+        return CACHE_STREAM;
+    }
+    
+    hit_update(my_cache, shard, found_ptr);
+    
+    return CACHE_HIT;
+}
+
+/*
+ * append_fill: Publish the next part of the response to the readers of the
+ *      placeholder returned by lookup_cache() (or keep it for them if the
+ *      fill is held). The fill buffer grows as needed up to the max object
+ *      size, a response bigger than that can't be appended.
+ * 
+ * return 1 = success, -1 = error or too big (nothing is appended)
+ */
+int 
+append_fill(cache_block *fill_ptr, void *buffer, int len) {
+    cache_fill *state_ptr = fill_ptr->fill;
+    char *data;
+    int capacity;
+    
+    P(&state_ptr->mutex);
+    
+    /* Never past the max object size */
+    if (len > state_ptr->limit - state_ptr->length) {
+        V(&state_ptr->mutex);
+        return -1;
+    }
+    
+    /* Grow the buffer, readers only copy from it under the mutex */
+    if (state_ptr->length + len > state_ptr->capacity) {
+        capacity = (state_ptr->capacity > 0) ? 
+        state_ptr->capacity : FILL_INIT_SIZE;
+        while (capacity < state_ptr->length + len) {
+            capacity *= 2;
+        }
+        if (capacity > state_ptr->limit) {
+            capacity = state_ptr->limit;
+        }
+        
+        if ((data = (char *)Realloc(state_ptr->data, capacity)) == NULL) {
+            V(&state_ptr->mutex);
+            return -1;
+        }
+        state_ptr->data = data;
+        state_ptr->capacity = capacity;
+    }
+    
+    memcpy(state_ptr->data + state_ptr->length, buffer, len);
+    state_ptr->length += len;
+    wake_fill(state_ptr);
+    
+    V(&state_ptr->mutex);
+    
+    return 1;
+}
+
+/*
+ * hold_fill: Keep what is appended to the placeholder from the readers until
+ *      fill_cache(). If the fill is aborted, the readers got nothing and
+ *      fetch the object by themselves. Called before anything is appended.
+ */
+void 
+hold_fill(cache_block *fill_ptr) {
+    P(&fill_ptr->fill->mutex);
+    fill_ptr->fill->held = 1;
+    V(&fill_ptr->fill->mutex);
+}
+
+/*
+ * read_fill: Copy at most maxlen bytes of the response starting at offset
+ *      from a placeholder pinned by lookup_cache(). Sleep if nothing new
+ *      was appended yet.
+ * 
+ * return number of bytes copied, 0 = end of response, 
+ *      -1 = fill aborted (the response is incomplete)
+ */
+int 
+read_fill(proxy_cache *my_cache, cache_block *fill_ptr, int offset, 
+void *buffer, int maxlen) {
+    cache_fill *state_ptr = fill_ptr->fill;
+    cache_shard *shard;
+    int read_len, length;
+    
+    P(&state_ptr->mutex);
+    
+    /* Wait for more data, a held fill shows nothing until it's done */
+    while (1) {
+        length = (state_ptr->held && state_ptr->state != FILL_DONE) ? 
+        0 : state_ptr->length;
+        if (offset < length || state_ptr->state != FILL_PENDING) {
+            break;
+        }
+        state_ptr->waiters += 1;
+        V(&state_ptr->mutex);
+        P(&state_ptr->wait);
+        P(&state_ptr->mutex);
+    }
+    
+    if (offset < length) {
+        read_len = length - offset;
+        if (read_len > maxlen) {
+            read_len = maxlen;
+        }
+        memcpy(buffer, state_ptr->data + offset, read_len);
+    }
+    else {
+        read_len = (state_ptr->state == FILL_ABORTED) ? -1 : 0;
+    }
+    
+    V(&state_ptr->mutex);
+    
+    if (read_len > 0) {
+        shard = get_shard(my_cache, fill_ptr->hash);
+        __sync_add_and_fetch(&shard->stats.hit_bytes, read_len);
+    }
+    
+    return read_len;
+}
+
+/*
+ * fill_cache: Write the response appended to the placeholder returned by
+ *      lookup_cache() to the cache (fresh for ttl seconds, with its
+ *      validators) and finish the fill. The readers finish from the fill
+ *      buffer even if the response is not cached (too big or not
+ *      admitted). The placeholder must not be used after this call.
+ * 
+ * return 1 = cached, -1 = not cached
+ */
+int 
+fill_cache(proxy_cache *my_cache, cache_block *fill_ptr, int ttl, 
+char *etag, char *last_modified) {
+    cache_fill *state_ptr = fill_ptr->fill;
+    
+    /* The filler is the only writer of the fill buffer and it's done */
+    return store_block(my_cache, get_shard(my_cache, fill_ptr->hash), 
+    fill_ptr->hash, fill_ptr->host, fill_ptr->uri, state_ptr->data, 
+    state_ptr->length, ttl, etag, last_modified, fill_ptr);
+}
+
+/*
+ * refresh_cache: The server answered the conditional request for a block
+ *      from CACHE_REVALIDATE with 304, the block is fresh for ttl more
+ *      seconds (it stays stale if ttl <= 0) and the request is served from
+ *      it as a hit. The block stays pinned.
+ */
+void 
+refresh_cache(proxy_cache *my_cache, cache_block *block_ptr, int ttl) {
+    cache_shard *shard = get_shard(my_cache, block_ptr->hash);
+    
+    if (ttl > 0) {
+        __atomic_store_n(&block_ptr->expires, cache_now() + ttl, 
+        __ATOMIC_RELAXED);
+    }
+    __sync_add_and_fetch(&shard->stats.revalidated, 1);
+    
+    hit_update(my_cache, shard, block_ptr);
+}
+
+/*
+ * abort_fill: Give up the placeholder returned by lookup_cache(), the
+ *      waiting requests fetch the object by themselves. The placeholder
+ *      must not be used after this call.
+ */
+void 
+abort_fill(proxy_cache *my_cache, cache_block *fill_ptr) {
+    cache_shard *shard = get_shard(my_cache, fill_ptr->hash);
+    
+    P(&shard->mutex_write);
+    table_remove(shard, fill_ptr);
+    V(&shard->mutex_write);
+    
+    finish_fill(fill_ptr, FILL_ABORTED);
+}
+
+/*
+ * write_cache: Write the content to the cache with synchronization, it
+ *      stays fresh for ttl seconds (not stored if ttl <= 0). etag and
+ *      last_modified are kept for revalidation, NULL or "" if none.
+ *      Only 1 writer is allowed to write a shard at a time.
+ * 
+ * return 1 = success, -1 = error
+ */
+int 
+write_cache(proxy_cache *my_cache, char *input_host, char *input_uri, 
+void *buffer, int len, int ttl, char *etag, char *last_modified) {
+    unsigned int hash;
+    
+    /* Ignore spurious request */
+    if (my_cache == NULL) {
+        return -1;
+    }
+    
+    hash = hash_key(input_host, input_uri);
+    
+    return store_block(my_cache, get_shard(my_cache, hash), hash, 
+    input_host, input_uri, buffer, len, ttl, etag, last_modified, NULL);
+}
+
+/*
+ * store_block: Put a new block in the shard with write permission, stale
+ *      after ttl seconds (not stored if ttl <= 0), with its validators. An old
+ *      copy of the same object is replaced. If fill_ptr is not NULL, the
+ *      placeholder is taken out of the index and finished.
+ * 
+ * return 1 = success, -1 = error
+ */
+int 
+store_block(proxy_cache *my_cache, cache_shard *shard, unsigned int hash, 
+char *input_host, char *input_uri, void *buffer, int len, int ttl, 
+char *etag, char *last_modified, cache_block *fill_ptr) {
+    cache_block *block_ptr = NULL, *old_ptr, *victim_ptr = NULL;
+    unsigned int charge = slab_chunk_size(my_cache->arena, 
+    block_size(input_host, input_uri, etag, last_modified, len));
+    
+    /* Semaphores: Lock write permission*/
+    P(&shard->mutex_write);
+    
+    /* Spread the rehash work over writes */
+    rehash_step(shard, CACHE_REHASH_STEP);
+    
+    if (fill_ptr != NULL) {
+        table_remove(shard, fill_ptr);
+    }
+    
+    /* Check freshness and length validity (the block must fit in the empty
+     * shard), admission check before evicting anything and GDSF needs a
+     * heap slot for the new block */
+    if (ttl > 0 && len <= my_cache->max_object_size && 
+    charge <= shard->capacity && 
+    (shard->space >= charge || admit_block(my_cache, shard, hash)) && 
+    (my_cache->policy != CACHE_GDSF || heap_reserve(shard) == 0)) {
+        
+        /* Take the old copy out first, its space can be reused */
+        old_ptr = search_block(shard, hash, input_host, input_uri);
+        if (old_ptr != NULL && old_ptr->fill == NULL) {
+            unlink_block(my_cache, shard, old_ptr);
+        }
+        else {
+            old_ptr = NULL;
+        }
+        
+        /* If there is not enough space, cut LRU blocks off in one batch,
+         * run the clock or evict the lowest GDSF priority */
+        if (my_cache->policy == CACHE_CLOCK) {
+            victim_ptr = clock_eviction(shard, charge);
+        }
+        else if (my_cache->policy == CACHE_GDSF) {
+            victim_ptr = gdsf_eviction(shard, charge);
+        }
+        else {
+            victim_ptr = eviction(shard, charge);
+        }
+        
+        if (old_ptr != NULL) {
+            old_ptr->prev_cache_block = NULL;
+            old_ptr->next_cache_block = victim_ptr;
+            victim_ptr = old_ptr;
+        }
+        
+        /* Create the block and write the content, unless its keys make it
+         * bigger than the whole shard */
+        if (shard->space >= charge) {
+            block_ptr = create_block(my_cache->arena, hash, input_host, 
+            input_uri, buffer, len, etag, last_modified);
+        }
+        
+        /* Insert to linked list and hash index */
+        if (block_ptr != NULL) {
+            block_ptr->expires = cache_now() + ttl;
+            insert_block(shard, block_ptr);
+            table_insert(shard, block_ptr);
+            if (my_cache->policy == CACHE_GDSF) {
+                block_ptr->priority = gdsf_priority(shard, block_ptr);
+                heap_push(shard, block_ptr);
+            }
+        }
+    }
+    
+    /* Semaphores: Unlock write permission */
+    V(&shard->mutex_write);
+    
+    /* The whole response is in the fill buffer either way */
+    if (fill_ptr != NULL) {
+        finish_fill(fill_ptr, FILL_DONE);
+    }
+    
+    /* Victims are unreachable now, release them outside the lock */
+    release_victims(victim_ptr);
+    
+    return (block_ptr != NULL) ? 1 : -1;
+}
+
+/*
+ * count_miss_bytes: Count the bytes the proxy fetched from server because
+ *      the object was not in cache. Used for byte hit ratio only.
+ */
+void 
+count_miss_bytes(proxy_cache *my_cache, char *input_host, 
+char *input_uri, long len) {
+    cache_shard *shard;
+    
+    if (my_cache == NULL) {
+        return;
+    }
+    
+    shard = get_shard(my_cache, hash_key(input_host, input_uri));
+    __sync_add_and_fetch(&shard->stats.miss_bytes, len);
+}
+
+/*
+ * get_cache_stats: Sum the counters of all shards. Counters keep moving while
+ *      we read them, the sum is a snapshot good enough for reporting.
+ */
+void 
+get_cache_stats(proxy_cache *my_cache, cache_stats *stats) {
+    cache_shard *shard;
+    int i;
+    
+    memset(stats, 0, sizeof(cache_stats));
+    
+    if (my_cache == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < my_cache->shard_count; i++) {
+        shard = &my_cache->shards[i];
+        stats->lookups += shard->stats.lookups;
+        stats->hits += shard->stats.hits;
+        stats->hit_bytes += shard->stats.hit_bytes;
+        stats->miss_bytes += shard->stats.miss_bytes;
+        stats->expired += shard->stats.expired;
+        stats->revalidated += shard->stats.revalidated;
+    }
+}
+
+/*
+ * print_cache_stats: Print the object hit ratio (hits / lookups) and the
+ *      byte hit ratio (bytes from cache / all bytes served) to fp.
+ */
+void 
+print_cache_stats(proxy_cache *my_cache, FILE *fp) {
+    cache_stats stats;
+    unsigned long total_bytes;
+    
+    get_cache_stats(my_cache, &stats);
+    total_bytes = stats.hit_bytes + stats.miss_bytes;
+    
+    fprintf(fp, "Cache: %lu lookups, %lu hits, object hit ratio %.3f, "
+    "byte hit ratio %.3f, %lu expired, %lu revalidated\n", stats.lookups, 
+    stats.hits, stats.lookups ? (double)stats.hits / stats.lookups : 0.0, 
+    total_bytes ? (double)stats.hit_bytes / total_bytes : 0.0, 
+    stats.expired, stats.revalidated);
+}
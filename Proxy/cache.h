@@ -7,45 +7,281 @@
  *     lab. We maintain the linked list of the occupied blocks
  *     and keep updating.
  * 
- * This cache uses 2 data struct. First is the proxy_cache. This data 
- *      structure will be access by proxy.c. The second is cache_block. 
- *      This is the block of linked list used to store data.
+ * This cache uses 3 data struct. First is the proxy_cache. This data 
+ *      structure will be access by proxy.c. The second is cache_shard.
+ *      The proxy_cache is split into shards by the hash of host and uri,
+ *      each shard is an independent cache with its own list, hash index,
+ *      space and semaphores, so requests to different shards never wait
+ *      for each other. The third is cache_block. This is the block of
+ *      linked list used to store data.
  * 
- * Eviction policy: LRU
+ * Eviction policy: LRU (within each shard) or CLOCK, chosen at init_cache().
+ *     With LRU every hit moves the block to the root, which needs write
+ *     permission. With CLOCK (second chance) a hit only sets the referenced
+ *     bit of the block. The clock hand moves from the tail toward the root
+ *     (and wraps) only when write_cache() needs space: a referenced block
+ *     gets its bit cleared and is passed over once, the first block found
+ *     without the bit is evicted.
+ *     With GDSF (GreedyDual-Size-Frequency) each block has the priority
+ *     L + frequency * GDSF_COST / size and the shard keeps its blocks in a
+ *     binary min-heap on that priority. The block with the lowest priority
+ *     is evicted and L (inflation) becomes its priority, so blocks that are
+ *     not hit again age out. Small and frequently used blocks stay, one big
+ *     object can't push out dozens of small hot ones. A hit increments the
+ *     frequency and fixes the heap, which needs write permission like LRU.
+ * 
+ * Collapsed forwarding: lookup_cache() lets only the first request for a
+ *     missing object fetch it. That request gets a placeholder block (a
+ *     block with fill state) put in the hash index, and must finish it with
+ *     fill_cache() or abort_fill(). Other requests for the same object find
+ *     the placeholder and are served from it while it is being filled.
+ *     Writing an object that is already cached replaces the old copy
+ *     instead of adding a duplicate.
+ * 
+ * Stream while filling: The filling request publishes the response with
+ *     append_fill() as it arrives from the server. The other requests copy
+ *     out what is there already with read_fill() and sleep until more is
+ *     appended, so they get the first bytes as soon as the server sends
+ *     them. fill_cache() then moves the response into a normal block (if it
+ *     fits) and the readers finish from the fill buffer. If the fill is
+ *     aborted before anything was published, the readers fetch the object
+ *     by themselves. Placeholders are never in the list, so they take no
+ *     space in the shard and are never evicted.
+ *     The fill buffer never grows past the max object size, append_fill()
+ *     fails and the filler aborts instead. A response of unknown length
+ *     (chunked or ended by close) can only tell it's too big on the way,
+ *     so the filler holds it back with hold_fill(): the readers get nothing
+ *     until fill_cache(), and fetch by themselves if the fill is aborted.
+ * 
+ * Freshness: Each block goes stale ttl seconds after it is written (the
+ *     caller gets ttl from the response headers, see response_ttl() in
+ *     http.h), a response with ttl <= 0 is not stored at all. A lookup
+ *     that finds a stale block counts it as a miss and takes it out of the
+ *     cache (lazy expiry), the caller fetches the object again. A hit only
+ *     compares the expiry time with a coarse clock. Stale blocks nobody
+ *     asks for are evicted like any other.
+ * 
+ * Revalidation: A block keeps the ETag and Last-Modified of its response
+ *     (the validators). A stale block with validators stays in the cache,
+ *     lookup_cache() hands it out pinned as CACHE_REVALIDATE so the caller
+ *     can ask the server whether it changed (a conditional request). If
+ *     the server answers 304 Not Modified, refresh_cache() makes it fresh
+ *     for another ttl and the request is served from it, the body is not
+ *     transferred again. A new response replaces it like any write.
+ * 
+ * Statistics: Each shard counts lookups, hits and the bytes served from the
+ *     cache. The proxy reports the bytes it fetched on a miss, so both the
+ *     object hit ratio and the byte hit ratio can be reported.
  * 
  * Insert policy: Always insert most recently used or new block at the root.
- *     Thus, the LRU block will always be at the end of the block list.
+ *     Thus, the LRU block will always be at the end of the block list. The
+ *     cache keeps a pointer to the end (tail) so eviction does not walk the
+ *     list, and one eviction cuts every victim it needs off the tail at once.
+ * 
+ * Admission policy: Every block is admitted by default. With
+ *     CACHE_ADMIT_TINYLFU (OR'ed into the policy) each shard keeps a
+ *     count-min sketch of how often each key was looked up. When a write
+ *     needs to evict, the new object is admitted only if it is looked up at
+ *     least as often as the block that would be evicted first, so a one-time
+ *     scan can't flush the frequently used blocks. The counters are halved
+ *     every SKETCH_SAMPLE lookups so old popularity fades (aging). The
+ *     sketch is updated without locks, the counts are approximate anyway.
  * 
  * Prioritization: Readers has higher priority
+ * 
+ * Pinning: pin_cache() hands out the block itself instead of a copy of the
+ *     payload. Each block counts its references, the cache holds one while
+ *     the block is in the list and every pin holds one more. An evicted
+ *     block leaves the list and the index at once (its space is returned to
+ *     the cache), but the memory is freed only when the last pin is dropped.
+ * 
+ * Memory: A block (header, host, uri and payload) lives in one chunk taken
+ *     from the slab arena of the cache (see slab.h), so creating and
+ *     freeing a block costs one allocation from a free list instead of four
+ *     Malloc/Free calls, and a hit touches one contiguous piece of memory.
+ *     The arena stops growing at CACHE_ARENA_FACTOR times the cache size.
+ *     A block takes its whole chunk (header, keys and the rounding up to
+ *     its size class) from the space of the shard, not only its payload.
+ *     A block bigger than a slab (32 KB for the default cache size, so
+ *     payloads from about 32 KB up to the max object size) is taken from
+ *     Malloc instead and charged its own size. A block that can't fit in
+ *     an empty shard is never stored, nothing is evicted for it.
+ * 
+ * Lookup: Blocks are also chained in a hash table keyed on (host, uri) so
+ *     that searching does not walk the list. The table doubles when it is
+ *     full and moves its buckets to the new table a few at a time on every
+ *     write (incremental rehash), so no single write holds the readers off
+ *     for a whole rehash. While rehashing, lookups check both tables.
  */
- 
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "slab.h"
 
-typedef struct proxy_cache {
+/* Hash index */
+#define CACHE_INIT_BUCKETS 64 /* Initial number of buckets (power of 2) */
+#define CACHE_REHASH_STEP 4 /* Buckets moved per write during rehash */
+
+/* Eviction policies */
+#define CACHE_LRU 0
+#define CACHE_CLOCK 1
+#define CACHE_GDSF 2
+#define CACHE_POLICY_MASK 0xff
+
+/* Admission policy, OR'ed into the eviction policy */
+#define CACHE_ADMIT_TINYLFU 0x100
+
+/* Frequency sketch for admission */
+#define SKETCH_DEPTH 4 /* Number of rows (hash functions) */
+#define SKETCH_WIDTH 4096 /* Counters per row (power of 2) */
+#define SKETCH_MAX_COUNT 15 /* Counters saturate here */
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH) /* Lookups between agings */
+
+typedef struct cache_sketch {
+    unsigned char count[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned int additions; /* Lookups recorded since the last aging */
+} cache_sketch;
+
+/* Results of lookup_cache() */
+#define CACHE_HIT 0 /* Block is pinned, serve it */
+#define CACHE_MISS 1 /* Not cached, fetch it without filling the cache */
+#define CACHE_FILL 2 /* Not cached, fetch it then fill_cache()/abort_fill() */
+#define CACHE_STREAM 3 /* Being fetched, read_fill() then unpin_cache() */
+#define CACHE_REVALIDATE 4 /* Stale block is pinned, ask the server */
+
+/* States of an in-flight fill */
+#define FILL_PENDING 0
+#define FILL_DONE 1
+#define FILL_ABORTED 2
+#define FILL_INIT_SIZE 8192 /* First size of the fill buffer, then doubles */
+
+/* Memory */
+#define CACHE_ARENA_FACTOR 2 /* Arena limit in multiple of cache size */
+
+/* GDSF */
+#define GDSF_COST 1.0 /* Cost to fetch one object (same for all objects) */
+#define GDSF_INIT_HEAP 64 /* Initial capacity of heap */
+
+typedef struct cache_stats {
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long hit_bytes; /* Bytes served from cache */
+    unsigned long miss_bytes; /* Bytes fetched from server on a miss */
+    unsigned long expired; /* Stale blocks found by lookups */
+    unsigned long revalidated; /* Stale blocks the server said are good */
+} cache_stats;
+
+typedef struct cache_fill {
+    int state; /* FILL_PENDING, FILL_DONE or FILL_ABORTED */
+    int waiters; /* Number of requests sleeping on wait */
+    char *data; /* Response received so far */
+    int length; /* Bytes appended to data */
+    int capacity; /* Size of data */
+    int limit; /* Most bytes appended, the max object size */
+    int held; /* 1 = readers get nothing until the fill is done */
+    sem_t mutex; /* Protects all fields above */
+    sem_t wait; /* Waiters sleep here until data or state changes */
+} cache_fill;
+
+typedef struct cache_table {
+    struct cache_block **buckets;
+    unsigned int size; /* Number of buckets, always power of 2 */
+    unsigned int used; /* Number of blocks in this table */
+} cache_table;
+
+typedef struct cache_shard {
     /* To manage the cache list */
-    unsigned int space; /* the remaining space in cache */
-    unsigned int max_object_size;
+    unsigned int space; /* the remaining space in this shard */
+    unsigned int capacity; /* space of the empty shard */
     struct cache_block *root; /* Pointer to the first block */
+    struct cache_block *tail; /* Pointer to the last (LRU) block */
+    struct cache_block *clock_hand; /* Next block to check, NULL = tail */
+    
+    /* To manage the hash index */
+    cache_table table[2]; /* table[1] is used only while rehashing */
+    int rehash_idx; /* Next bucket of table[0] to move, -1 = not rehashing */
+    
+    /* Lookup frequency, NULL if admission policy is not used */
+    cache_sketch *sketch;
+    
+    /* GDSF priority queue, NULL if GDSF is not used */
+    struct cache_block **heap; /* Min-heap on priority */
+    int heap_size;
+    int heap_capacity;
+    double inflation; /* L, priority of the last evicted block */
+    
+    /* Counters, updated atomically */
+    cache_stats stats;
     
     /* Semaphores */
     unsigned int readcnt;
     sem_t mutex_read;
     sem_t mutex_write;
+} cache_shard;
+
+typedef struct proxy_cache {
+    unsigned int max_object_size;
+    int policy; /* CACHE_LRU, CACHE_CLOCK or CACHE_GDSF */
+    int admission; /* 0 = admit all, CACHE_ADMIT_TINYLFU */
+    int shard_count;
+    int default_ttl; /* Seconds fresh without max-age or Expires */
+    cache_shard *shards;
+    slab_arena *arena; /* Memory of all blocks */
 } proxy_cache;
 
 typedef struct cache_block {
     int payload_size;
+    unsigned int charge; /* Bytes taken from the shard space, whole chunk */
+    unsigned long expires; /* Stale at this cache_now() time, 0 = never */
+    int refcnt; /* Cache reference + pins, updated atomically */
+    int evicted; /* Set once the block is taken out of the cache */
+    int referenced; /* CLOCK referenced bit, set atomically on hit */
+    int frequency; /* GDSF number of hits + 1 */
+    int heap_index; /* GDSF position in heap */
+    double priority; /* GDSF priority */
     char *host; /* For searching */
     char *uri;  /* For searching */
+    char *etag; /* Validators, NULL if the response has none */
+    char *last_modified;
+    unsigned int hash; /* Hash of host and uri */
+    struct cache_block *next_hash_block; /* Next block in the same bucket */
     struct cache_block *next_cache_block;
     struct cache_block *prev_cache_block;
     void *payload;
+    slab_class *slab_class; /* Size class of this chunk, NULL = Malloc */
+    cache_fill *fill; /* Not NULL for placeholder of in-flight fetch */
 } cache_block;
 
 /* Functions used in proxy.c*/
-proxy_cache *init_cache(int max_cache_size, int input_max_object_size);
+proxy_cache *init_cache(int max_cache_size, int input_max_object_size, 
+int shard_count, int policy, int default_ttl);
 int read_cache(proxy_cache *my_cache, char *input_host, 
 char *input_uri, void *buffer);
 
 int write_cache(proxy_cache *my_cache, char *input_host, 
-char *inut_uri, void *buffer, int len);
+char *inut_uri, void *buffer, int len, int ttl, char *etag, 
+char *last_modified);
+
+cache_block *pin_cache(proxy_cache *my_cache, char *input_host, 
+char *input_uri);
+void unpin_cache(proxy_cache *my_cache, cache_block *block_ptr);
+
+int lookup_cache(proxy_cache *my_cache, char *input_host, char *input_uri, 
+cache_block **block_ptr);
+int append_fill(cache_block *fill_ptr, void *buffer, int len);
+void hold_fill(cache_block *fill_ptr);
+int read_fill(proxy_cache *my_cache, cache_block *fill_ptr, int offset, 
+void *buffer, int maxlen);
+int fill_cache(proxy_cache *my_cache, cache_block *fill_ptr, int ttl, 
+char *etag, char *last_modified);
+void refresh_cache(proxy_cache *my_cache, cache_block *block_ptr, int ttl);
+void abort_fill(proxy_cache *my_cache, cache_block *fill_ptr);
+
+void count_miss_bytes(proxy_cache *my_cache, char *input_host, 
+char *input_uri, long len);
+void get_cache_stats(proxy_cache *my_cache, cache_stats *stats);
+void print_cache_stats(proxy_cache *my_cache, FILE *fp);
+
+#endif /* __CACHE_H__ */
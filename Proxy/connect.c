@@ -0,0 +1,183 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * connect.c: implementation of connect.h, connection race
+ */
+
+#include "connect.h"
+
+/* Functions prototype used only in connect.c */
+static long now_msec(void);
+static int order_addrs(dns_addr *addrs, int count, int *order);
+static int start_attempt(dns_addr *addr);
+static void set_blocking(int fd);
+
+/* Functions */
+
+/*
+ * now_msec: Monotonic clock in milliseconds
+ */
+long 
+now_msec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * order_addrs: Write the indexes of addrs to order in the order they are
+ *      tried, the families take turns from the family of addrs[0]
+ * 
+ * return number of indexes
+ */
+int 
+order_addrs(dns_addr *addrs, int count, int *order) {
+    int next[2] = {0, 0}; /* Next index to check for each family */
+    int turn = 0; /* 0 = family of addrs[0], 1 = the others */
+    int n = 0, i, same;
+    
+    while (n < count) {
+        /* Find the next address of this turn's family */
+        for (i = next[turn]; i < count; i++) {
+            same = (addrs[i].family == addrs[0].family);
+            if (same == !turn) {
+                break;
+            }
+        }
+        next[turn] = i + 1;
+        
+        if (i < count) {
+            order[n++] = i;
+        }
+        else if (next[!turn] > count) {
+            break; /* Both families are done */
+        }
+        turn = !turn;
+    }
+    
+    return n;
+}
+
+/*
+ * start_attempt: Start a non-blocking connect to addr
+ * 
+ * return socket if the connect is started (or done), -1 if it failed
+ */
+int 
+start_attempt(dns_addr *addr) {
+    int fd;
+    
+    if ((fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        return -1;
+    }
+    
+    if (connect(fd, (SA *)&addr->addr, addr->addrlen) == 0 || 
+    errno == EINPROGRESS) {
+        return fd;
+    }
+    
+    close(fd);
+    return -1;
+}
+
+/*
+ * set_blocking: Give the winner back to the blocking Rio functions
+ */
+void 
+set_blocking(int fd) {
+    int flags;
+    
+    if ((flags = fcntl(fd, F_GETFL, 0)) >= 0) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+}
+
+/*
+ * connect_race: Connect to one of the count addresses (at most
+ *      DNS_MAX_ADDRS), see connect.h. *winner is set to the index of the
+ *      address that connected.
+ * 
+ * return blocking connected socket, -1 if none connected in timeout_ms
+ */
+int 
+connect_race(dns_addr *addrs, int count, int timeout_ms, int *winner) {
+    int order[DNS_MAX_ADDRS];
+    struct pollfd fds[DNS_MAX_ADDRS]; /* Attempts in progress */
+    int fd_index[DNS_MAX_ADDRS]; /* Address index of each attempt */
+    int pending = 0, started = 0, connfd = -1;
+    int i, fd, error;
+    socklen_t error_len;
+    long now, deadline, next_start, wait;
+    
+    count = order_addrs(addrs, count, order);
+    now = now_msec();
+    deadline = now + timeout_ms;
+    next_start = now;
+    
+    while (connfd < 0 && now < deadline && (pending > 0 || started < count)) {
+        
+        /* Time for the next attempt, or nothing else to wait for */
+        if (started < count && (now >= next_start || pending == 0)) {
+            i = order[started++];
+            if ((fd = start_attempt(&addrs[i])) >= 0) {
+                fds[pending].fd = fd;
+                fds[pending].events = POLLOUT;
+                fd_index[pending] = i;
+                pending += 1;
+                next_start = now + CONNECT_STAGGER_MS;
+            }
+            else {
+                next_start = now; /* Next address right away */
+            }
+            continue;
+        }
+        
+        /* Wait for an attempt to end or for the next one to start */
+        wait = deadline - now;
+        if (started < count && next_start - now < wait) {
+            wait = next_start - now;
+        }
+        if (poll(fds, pending, (int)wait) < 0 && errno != EINTR) {
+            break;
+        }
+        
+        /* Check the attempts that are done */
+        for (i = 0; i < pending && connfd < 0; ) {
+            if (fds[i].revents == 0) {
+                i++;
+                continue;
+            }
+            
+            error_len = sizeof(error);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, 
+            &error_len) == 0 && error == 0) {
+                connfd = fds[i].fd;
+                *winner = fd_index[i];
+            }
+            else {
+                close(fds[i].fd);
+                next_start = now; /* Next address right away */
+            }
+            
+            /* Remove the attempt */
+            pending -= 1;
+            fds[i] = fds[pending];
+            fd_index[i] = fd_index[pending];
+        }
+        
+        now = now_msec();
+    }
+    
+    /* Close the losers */
+    for (i = 0; i < pending; i++) {
+        close(fds[i].fd);
+    }
+    
+    if (connfd >= 0) {
+        set_blocking(connfd);
+    }
+    
+    return connfd;
+}
@@ -0,0 +1,33 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * connect.h: header file for the connection race to the remote server
+ *     (Happy Eyeballs, RFC 8305)
+ *     Connecting to the resolved addresses one after another with a
+ *     blocking connect() makes a request wait for the kernel timeout (can
+ *     be minutes) when the first address is dead. connect_race() starts a
+ *     non-blocking connect to the first address, then one more every
+ *     CONNECT_STAGGER_MS while none has succeeded (or right away when one
+ *     fails). The first connection that succeeds wins, the others are
+ *     closed. The whole race gives up after timeout_ms.
+ * 
+ * Order: The addresses are tried in resolver order, but the families take
+ *     turns (IPv6 and IPv4) from the family of the first address, so a
+ *     broken family costs one stagger only. The resolver cache returns the
+ *     last good address first, so it is usually the only attempt.
+ */
+
+#ifndef __CONNECT_H__
+#define __CONNECT_H__
+
+#include "csapp.h"
+#include "dns.h"
+#include <poll.h>
+
+#define CONNECT_STAGGER_MS 250 /* Delay before the next attempt starts */
+
+/* Functions used in proxy.c */
+int connect_race(dns_addr *addrs, int count, int timeout_ms, int *winner);
+
+#endif /* __CONNECT_H__ */
@@ -577,18 +577,11 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
 
 /* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - refill the internal buffer with read() if it is empty
+ *    Returns the number of unread bytes, 0 on EOF, -1 on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -601,6 +594,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)  /* refill if buf is empty */
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -653,31 +665,88 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - robustly read a text line (buffered)
+ *    The newline is found with memchr() in the internal buffer and the
+ *    whole line is copied at once instead of one rio_read() per byte.
+ *    Returns the number of bytes read (without the terminating null).
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (n + 1 < maxlen && nl == NULL) {
+	if (rp->rio_cnt <= 0) {
+	    if ((rc = rio_fill(rp)) < 0)
+		return -1;	  /* error */
+	    else if (rc == 0)
+		break;	  /* EOF */
+	}
+
+	/* Copy up to the newline, or as much as fits */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/* 
+ * rio_readlinev - read a text line (buffered) without copying it
+ *    *linep points to the line in the internal buffer, it is valid until
+ *    the next read from rp. The unread bytes are moved to the front of
+ *    the buffer to make room for a line that is not all there. A line
+ *    longer than RIO_BUFSIZE is returned in pieces.
+ *    Returns the length of the line (not null terminated), 0 on EOF.
+ */
+ssize_t rio_readlinev(rio_t *rp, char **linep) 
+{
+    char *nl;
+    ssize_t rc;
+    size_t cnt;
+
+    while ((nl = memchr(rp->rio_bufptr, '\n', 
+			rp->rio_cnt > 0 ? rp->rio_cnt : 0)) == NULL) {
+	if (rp->rio_cnt >= (int)sizeof(rp->rio_buf))
+	    break;	  /* Buffer is full, return a piece */
+
+	/* Make room after the unread bytes and read more */
+	if (rp->rio_cnt <= 0)
+	    rp->rio_cnt = 0;
+	else if (rp->rio_bufptr != rp->rio_buf)
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, 
+		  sizeof(rp->rio_buf) - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR) /* interrupted by sig handler return */
+		return -1;
+	}
+	else if (rc == 0)  /* EOF, return what is left */
+	    break;
+	else
+	    rp->rio_cnt += rc;
+    }
+
+    cnt = (nl != NULL) ? (size_t)(nl - rp->rio_bufptr + 1) : 
+	(size_t)(rp->rio_cnt > 0 ? rp->rio_cnt : 0);
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
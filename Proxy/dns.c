@@ -0,0 +1,402 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * dns.c: implementation of dns.h, resolver cache
+ */
+
+#include "dns.h"
+
+/* Argument of a refresh thread */
+typedef struct dns_refresh {
+    dns_cache *dns;
+    char key[DNS_KEY_SIZE]; /* Key and hash of the entry */
+    unsigned int hash;
+    char host[DNS_KEY_SIZE];
+    char port[DNS_KEY_SIZE];
+} dns_refresh;
+
+/* Functions prototype used only in dns.c */
+static unsigned long now_sec(void);
+static unsigned int hash_key(char *key);
+static dns_entry *find_entry(dns_cache *dns, char *key, unsigned int hash);
+static int resolve(char *host, char *port, dns_addr *addrs);
+static void store_entry(dns_cache *dns, char *key, unsigned int hash, 
+dns_addr *addrs, int count, unsigned long now);
+static void remove_expired(dns_cache *dns, unsigned long now);
+static int copy_addrs(dns_entry *entry, dns_addr *addrs);
+static void start_refresh(dns_cache *dns, dns_entry *entry, char *host, 
+char *port);
+static void *refresh(void *vargp);
+
+/* Functions */
+
+/*
+ * init_dns_cache: Create an empty resolver cache
+ * 
+ * return cache pointer if success, NULL if not enough space
+ */
+dns_cache 
+*init_dns_cache(int ttl) {
+    dns_cache *dns;
+    int i;
+    
+    if ((dns = (dns_cache *)Malloc(sizeof(dns_cache))) == NULL) {
+        return NULL;
+    }
+    
+    dns->ttl = ttl;
+    dns->entries = 0;
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        dns->buckets[i] = NULL;
+    }
+    dns->hits = 0;
+    dns->misses = 0;
+    dns->negative_hits = 0;
+    dns->refreshes = 0;
+    Sem_init(&dns->mutex, 0, 1);
+    
+    return dns;
+}
+
+/*
+ * now_sec: Monotonic clock in seconds
+ */
+unsigned long 
+now_sec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec;
+}
+
+/*
+ * hash_key: FNV-1a hash of the key
+ */
+unsigned int 
+hash_key(char *key) {
+    unsigned int hash = 2166136261u;
+    
+    while (*key != '\0') {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * find_entry: Search the entry of key. Must be called with the mutex.
+ * 
+ * return entry pointer, NULL if not found
+ */
+dns_entry 
+*find_entry(dns_cache *dns, char *key, unsigned int hash) {
+    dns_entry *entry;
+    
+    for (entry = dns->buckets[hash % DNS_BUCKETS]; entry != NULL; 
+    entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * resolve: Ask the resolver for the stream addresses of host:port, at
+ *      most DNS_MAX_ADDRS of them
+ * 
+ * return number of addresses, 0 if host can't be resolved
+ */
+int 
+resolve(char *host, char *port, dns_addr *addrs) {
+    struct addrinfo hints, *addlist, *p;
+    int count = 0;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    if (getaddrinfo(host, port, &hints, &addlist) != 0) {
+        return 0;
+    }
+    
+    for (p = addlist; p != NULL && count < DNS_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&addrs[count].addr, p->ai_addr, p->ai_addrlen);
+        addrs[count].addrlen = p->ai_addrlen;
+        addrs[count].family = p->ai_family;
+        count += 1;
+    }
+    
+    freeaddrinfo(addlist);
+    
+    return count;
+}
+
+/*
+ * store_entry: Put the result of the resolver in the entry of key, create
+ *      it if needed (unless the table is full). A negative entry (count
+ *      = 0) never replaces addresses that are still valid. Must be called
+ *      with the mutex.
+ */
+void 
+store_entry(dns_cache *dns, char *key, unsigned int hash, 
+dns_addr *addrs, int count, unsigned long now) {
+    dns_entry *entry;
+    dns_entry **bucket;
+    
+    if ((entry = find_entry(dns, key, hash)) == NULL) {
+        if (dns->entries >= DNS_MAX_ENTRIES) {
+            remove_expired(dns, now);
+        }
+        if (dns->entries >= DNS_MAX_ENTRIES || 
+        (entry = (dns_entry *)Malloc(sizeof(dns_entry))) == NULL) {
+            return;
+        }
+        
+        strcpy(entry->key, key);
+        entry->hash = hash;
+        entry->count = 0;
+        entry->has_good = 0;
+        entry->expires = 0;
+        entry->refreshing = 0;
+        bucket = &dns->buckets[hash % DNS_BUCKETS];
+        entry->next = *bucket;
+        *bucket = entry;
+        dns->entries += 1;
+    }
+    
+    if (count > 0) {
+        memcpy(entry->addrs, addrs, count * sizeof(dns_addr));
+        entry->count = count;
+        entry->expires = now + dns->ttl;
+    }
+    else if (entry->count == 0 || entry->expires <= now) {
+        entry->count = 0;
+        entry->expires = now + DNS_NEGATIVE_TTL;
+    }
+}
+
+/*
+ * remove_expired: Free the expired entries that are not being refreshed.
+ *      Must be called with the mutex.
+ */
+void 
+remove_expired(dns_cache *dns, unsigned long now) {
+    dns_entry **link_ptr, *entry;
+    int i;
+    
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        link_ptr = &dns->buckets[i];
+        while ((entry = *link_ptr) != NULL) {
+            if (entry->expires <= now && !entry->refreshing) {
+                *link_ptr = entry->next;
+                Free(entry);
+                dns->entries -= 1;
+            }
+            else {
+                link_ptr = &entry->next;
+            }
+        }
+    }
+}
+
+/*
+ * copy_addrs: Copy the addresses of entry to addrs, the last good one
+ *      first. Must be called with the mutex.
+ * 
+ * return number of addresses
+ */
+int 
+copy_addrs(dns_entry *entry, dns_addr *addrs) {
+    int i, first = 0;
+    
+    memcpy(addrs, entry->addrs, entry->count * sizeof(dns_addr));
+    
+    if (!entry->has_good) {
+        return entry->count;
+    }
+    
+    for (i = 0; i < entry->count; i++) {
+        if (addrs[i].addrlen == entry->good.addrlen && 
+        !memcmp(&addrs[i].addr, &entry->good.addr, addrs[i].addrlen)) {
+            first = i;
+            break;
+        }
+    }
+    
+    if (first > 0) {
+        addrs[first] = addrs[0];
+        addrs[0] = entry->good;
+    }
+    
+    return entry->count;
+}
+
+/*
+ * dns_resolve: Get the addresses of host:port into addrs (DNS_MAX_ADDRS
+ *      of them at most) from the cache, or from the resolver if the cache
+ *      doesn't have them. If dns is NULL, the resolver is always used.
+ * 
+ * return number of addresses, -1 if host can't be resolved
+ */
+int 
+dns_resolve(dns_cache *dns, char *host, char *port, dns_addr *addrs) {
+    char key[DNS_KEY_SIZE];
+    unsigned int hash;
+    unsigned long now;
+    dns_entry *entry;
+    int count;
+    
+    if (dns == NULL || 
+    snprintf(key, DNS_KEY_SIZE, "%s:%s", host, port) >= DNS_KEY_SIZE) {
+        return (count = resolve(host, port, addrs)) > 0 ? count : -1;
+    }
+    hash = hash_key(key);
+    now = now_sec();
+    
+    P(&dns->mutex);
+    
+    if ((entry = find_entry(dns, key, hash)) != NULL && 
+    entry->expires > now) {
+        if (entry->count == 0) {
+            dns->negative_hits += 1;
+            V(&dns->mutex);
+            return -1;
+        }
+        
+        /* Hot entry close to expire, refresh it before it does */
+        if (!entry->refreshing && 
+        (entry->expires - now) * 100 <= 
+        (unsigned long)dns->ttl * DNS_REFRESH_PERCENT) {
+            start_refresh(dns, entry, host, port);
+        }
+        
+        dns->hits += 1;
+        count = copy_addrs(entry, addrs);
+        V(&dns->mutex);
+        return count;
+    }
+    
+    dns->misses += 1;
+    V(&dns->mutex);
+    
+    /* Not cached or expired, ask the resolver without the mutex */
+    count = resolve(host, port, addrs);
+    
+    P(&dns->mutex);
+    store_entry(dns, key, hash, addrs, count, now_sec());
+    if (count > 0 && (entry = find_entry(dns, key, hash)) != NULL) {
+        count = copy_addrs(entry, addrs);
+    }
+    V(&dns->mutex);
+    
+    return (count > 0) ? count : -1;
+}
+
+/*
+ * start_refresh: Resolve the entry again in a new thread. Must be called
+ *      with the mutex.
+ */
+void 
+start_refresh(dns_cache *dns, dns_entry *entry, char *host, char *port) {
+    dns_refresh *refresh_ptr;
+    pthread_t tid;
+    
+    if ((refresh_ptr = (dns_refresh *)Malloc(sizeof(dns_refresh))) == NULL) {
+        return;
+    }
+    
+    refresh_ptr->dns = dns;
+    strcpy(refresh_ptr->key, entry->key);
+    refresh_ptr->hash = entry->hash;
+    strcpy(refresh_ptr->host, host);
+    strcpy(refresh_ptr->port, port);
+    
+    /* Try again at the next use if there is no thread */
+    if (pthread_create(&tid, NULL, refresh, (void *)refresh_ptr) != 0) {
+        Free(refresh_ptr);
+        return;
+    }
+    
+    entry->refreshing = 1;
+    dns->refreshes += 1;
+}
+
+/*
+ * refresh: Refresh thread, put the new addresses in the entry. If the
+ *      resolver fails, the old ones stay until they expire.
+ */
+void 
+*refresh(void *vargp) {
+    dns_refresh *refresh_ptr = (dns_refresh *)vargp;
+    dns_cache *dns = refresh_ptr->dns;
+    dns_addr addrs[DNS_MAX_ADDRS];
+    dns_entry *entry;
+    int count;
+    
+    Pthread_detach(pthread_self());
+    
+    count = resolve(refresh_ptr->host, refresh_ptr->port, addrs);
+    
+    P(&dns->mutex);
+    store_entry(dns, refresh_ptr->key, refresh_ptr->hash, addrs, count, 
+    now_sec());
+    if ((entry = find_entry(dns, refresh_ptr->key, 
+    refresh_ptr->hash)) != NULL) {
+        entry->refreshing = 0;
+    }
+    V(&dns->mutex);
+    
+    Free(refresh_ptr);
+    return NULL;
+}
+
+/*
+ * dns_connected: Remember that a connection to host:port succeeded with
+ *      addr, it is tried first next time
+ */
+void 
+dns_connected(dns_cache *dns, char *host, char *port, 
+struct sockaddr *addr, socklen_t addrlen) {
+    char key[DNS_KEY_SIZE];
+    unsigned int hash;
+    dns_entry *entry;
+    
+    if (dns == NULL || addrlen > sizeof(struct sockaddr_storage) || 
+    snprintf(key, DNS_KEY_SIZE, "%s:%s", host, port) >= DNS_KEY_SIZE) {
+        return;
+    }
+    hash = hash_key(key);
+    
+    P(&dns->mutex);
+    if ((entry = find_entry(dns, key, hash)) != NULL) {
+        memcpy(&entry->good.addr, addr, addrlen);
+        entry->good.addrlen = addrlen;
+        entry->good.family = addr->sa_family;
+        entry->has_good = 1;
+    }
+    V(&dns->mutex);
+}
+
+/*
+ * print_dns_stats: Print resolver cache statistics to fp
+ */
+void 
+print_dns_stats(dns_cache *dns, FILE *fp) {
+    unsigned long hits, misses, negative_hits, refreshes;
+    int entries;
+    
+    P(&dns->mutex);
+    hits = dns->hits;
+    misses = dns->misses;
+    negative_hits = dns->negative_hits;
+    refreshes = dns->refreshes;
+    entries = dns->entries;
+    V(&dns->mutex);
+    
+    fprintf(fp, "DNS: %d entries, %lu hits, %lu misses, %lu negative hits, "
+    "%lu refreshes\n", entries, hits, misses, negative_hits, refreshes);
+}
@@ -0,0 +1,79 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * dns.h: header file for the resolver cache of the proxy
+ *     Every miss used to call getaddrinfo() for the remote server, even for
+ *     the same few hosts. dns_resolve() keeps the addresses of each
+ *     host:port for ttl seconds, so only the first request (and the ones
+ *     after the entry expires) wait for the resolver.
+ * 
+ * Negative entries: A host that can't be resolved is remembered for
+ *     DNS_NEGATIVE_TTL seconds, requests for it fail right away instead of
+ *     asking the resolver again.
+ * 
+ * Refresh: getaddrinfo() doesn't tell the TTL of the records, so every
+ *     entry lives for the same ttl. When an entry is used during the last
+ *     DNS_REFRESH_PERCENT percent of its life, a thread resolves it again
+ *     in the background. A host that is used often is then never expired
+ *     in front of a request. If the refresh fails, the old addresses are
+ *     kept until they expire.
+ * 
+ * Last good address: dns_connected() records the address a connection to
+ *     host:port succeeded with, it is returned first afterwards so a dead
+ *     address in front of the list is not tried every time.
+ * 
+ * Synchronization: One mutex protects the table, the addresses are copied
+ *     out so the caller never uses an entry that a refresh replaces. The
+ *     resolver is never called with the mutex.
+ */
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256
+#define DNS_KEY_SIZE 512 /* Longer host:port is never cached */
+#define DNS_MAX_ADDRS 8 /* Addresses kept per host:port */
+#define DNS_MAX_ENTRIES 4096
+#define DNS_NEGATIVE_TTL 5 /* Seconds */
+#define DNS_REFRESH_PERCENT 20
+
+typedef struct dns_addr {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family;
+} dns_addr;
+
+typedef struct dns_entry {
+    char key[DNS_KEY_SIZE]; /* host:port */
+    unsigned hash;
+    int count; /* Number of addrs, 0 = negative entry */
+    dns_addr addrs[DNS_MAX_ADDRS];
+    dns_addr good; /* Last address a connection succeeded with */
+    int has_good;
+    unsigned long expires; /* Seconds */
+    int refreshing; /* 1 = a refresh thread is running */
+    struct dns_entry *next; /* Next entry in the bucket */
+} dns_entry;
+
+typedef struct dns_cache {
+    int ttl; /* Seconds */
+    int entries;
+    dns_entry *buckets[DNS_BUCKETS];
+    unsigned long hits; /* Statistics, protected by mutex */
+    unsigned long misses;
+    unsigned long negative_hits;
+    unsigned long refreshes;
+    sem_t mutex;
+} dns_cache;
+
+/* Functions used in proxy.c and event.c */
+dns_cache *init_dns_cache(int ttl);
+int dns_resolve(dns_cache *dns, char *host, char *port, dns_addr *addrs);
+void dns_connected(dns_cache *dns, char *host, char *port, 
+struct sockaddr *addr, socklen_t addrlen);
+void print_dns_stats(dns_cache *dns, FILE *fp);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,751 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * event.c: implementation of event.h, event driven proxy on epoll
+ * 
+ * Interest: Only the socket the state machine is waiting for is watched.
+ *     Level triggered epoll is used, so a handler may stop at EAGAIN and
+ *     is called again when the socket is ready.
+ */
+
+#include "event.h"
+
+/* Functions prototype used only in event.c */
+static void set_nonblocking(int fd);
+static void watch_fd(event_loop *loop, int fd, int op, unsigned int events);
+static void track_fd(event_loop *loop, int fd, event_conn *conn);
+static int connect_server(event_loop *loop, char *hostname, char *port);
+static long now_msec(void);
+static void start_connect_timer(event_loop *loop, event_conn *conn);
+static void stop_connect_timer(event_loop *loop, event_conn *conn);
+static int expire_connects(event_loop *loop);
+static void accept_conns(event_loop *loop);
+static void close_conn(event_loop *loop, event_conn *conn);
+static void client_event(event_loop *loop, event_conn *conn, 
+unsigned int events);
+static void server_event(event_loop *loop, event_conn *conn, 
+unsigned int events);
+static void read_request(event_loop *loop, event_conn *conn);
+static void start_request(event_loop *loop, event_conn *conn);
+static int keep_key(event_conn *conn, char *host, char *uri);
+static void send_cached(event_loop *loop, event_conn *conn);
+static void send_request(event_loop *loop, event_conn *conn);
+static void read_response(event_loop *loop, event_conn *conn);
+static int send_response(event_loop *loop, event_conn *conn);
+static void keep_content(event_loop *loop, event_conn *conn, 
+char *data, int len);
+static void finish_response(event_loop *loop, event_conn *conn);
+
+/* Functions */
+
+/*
+ * run_event_loop: Serve the connections accepted from listenfd until the
+ *      program ends. Only returns if epoll can't be used.
+ */
+void 
+run_event_loop(int listenfd, proxy_cache *my_cache, dns_cache *dns, 
+int connect_timeout) {
+    event_loop loop;
+    event_conn *conn;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    int i, event_count, fd;
+    
+    loop.listenfd = listenfd;
+    loop.cache = my_cache;
+    loop.dns = dns;
+    loop.conns = NULL;
+    loop.conn_size = 0;
+    loop.connect_timeout = connect_timeout;
+    loop.connect_head = NULL;
+    loop.connect_tail = NULL;
+    
+    if ((loop.epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+        return;
+    }
+    
+    /* Accept until there is no more connection waiting */
+    set_nonblocking(listenfd);
+    watch_fd(&loop, listenfd, EPOLL_CTL_ADD, EPOLLIN);
+    
+    while (1) {
+        /* Sleep until the first connect is due, if any */
+        if ((event_count = epoll_wait(loop.epfd, events, 
+        EVENT_MAX_EVENTS, expire_connects(&loop))) < 0) {
+            if (errno != EINTR) {
+                unix_error("epoll_wait error");
+            }
+            continue;
+        }
+        
+        for (i = 0; i < event_count; i++) {
+            fd = events[i].data.fd;
+            
+            if (fd == listenfd) {
+                accept_conns(&loop);
+                continue;
+            }
+            
+            /* Connection may be closed by an earlier event */
+            if (fd >= loop.conn_size || (conn = loop.conns[fd]) == NULL) {
+                continue;
+            }
+            
+            if (fd == conn->client_fd) {
+                client_event(&loop, conn, events[i].events);
+            }
+            else {
+                server_event(&loop, conn, events[i].events);
+            }
+        }
+    }
+}
+
+/*
+ * set_nonblocking: Make the operations on fd return EAGAIN instead of
+ *      blocking
+ */
+void 
+set_nonblocking(int fd) {
+    int flags;
+    
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 || 
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        unix_error("fcntl error");
+    }
+}
+
+/*
+ * watch_fd: Add fd to epoll, change the events we wait for or remove it
+ *      (op is EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL). Errors and
+ *      hang up are always reported, even with no events.
+ */
+void 
+watch_fd(event_loop *loop, int fd, int op, unsigned int events) {
+    struct epoll_event event;
+    
+    event.events = events;
+    event.data.fd = fd;
+    
+    if (epoll_ctl(loop->epfd, op, fd, &event) < 0) {
+        unix_error("epoll_ctl error");
+    }
+}
+
+/*
+ * track_fd: Remember the connection of fd (NULL to forget), the table grows
+ *      to fit the biggest fd
+ */
+void 
+track_fd(event_loop *loop, int fd, event_conn *conn) {
+    event_conn **conns;
+    int size, i;
+    
+    if (fd >= loop->conn_size) {
+        size = (loop->conn_size > 0) ? loop->conn_size : EVENT_MAX_EVENTS;
+        while (size <= fd) {
+            size *= 2;
+        }
+        
+        if ((conns = (event_conn **)Realloc(loop->conns, 
+        size * sizeof(event_conn *))) == NULL) {
+            return;
+        }
+        for (i = loop->conn_size; i < size; i++) {
+            conns[i] = NULL;
+        }
+        loop->conns = conns;
+        loop->conn_size = size;
+    }
+    
+    loop->conns[fd] = conn;
+}
+
+/*
+ * connect_server: Start a non-blocking connection to the remote server.
+ *      The connection is done when the socket becomes writable.
+ * 
+ * return socket if success, -1 if error
+ */
+int 
+connect_server(event_loop *loop, char *hostname, char *port) {
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int serverfd = -1;
+    int count, i;
+    
+    if ((count = dns_resolve(loop->dns, hostname, port, addrs)) < 0) {
+        return -1;
+    }
+    
+    /* Walk the list, until one connect starts */
+    for (i = 0; i < count; i++) {
+        if ((serverfd = socket(addrs[i].family, SOCK_STREAM, 0)) < 0) {
+            continue;
+        }
+        
+        set_nonblocking(serverfd);
+        if (connect(serverfd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 || 
+        errno == EINPROGRESS) {
+            break; /* success */
+        }
+        
+        close(serverfd);
+        serverfd = -1;
+    }
+    
+    return serverfd;
+}
+
+/*
+ * now_msec: Monotonic clock in milliseconds
+ */
+long 
+now_msec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * start_connect_timer: Put the connection at the end of the connecting list,
+ *      all of them have the same timeout so the list stays in deadline order
+ */
+void 
+start_connect_timer(event_loop *loop, event_conn *conn) {
+    conn->connect_deadline = now_msec() + loop->connect_timeout;
+    conn->connect_prev = loop->connect_tail;
+    conn->connect_next = NULL;
+    
+    if (loop->connect_tail != NULL) {
+        loop->connect_tail->connect_next = conn;
+    }
+    else {
+        loop->connect_head = conn;
+    }
+    loop->connect_tail = conn;
+}
+
+/*
+ * stop_connect_timer: Take the connection out of the connecting list
+ */
+void 
+stop_connect_timer(event_loop *loop, event_conn *conn) {
+    if (conn->connect_prev != NULL) {
+        conn->connect_prev->connect_next = conn->connect_next;
+    }
+    else {
+        loop->connect_head = conn->connect_next;
+    }
+    
+    if (conn->connect_next != NULL) {
+        conn->connect_next->connect_prev = conn->connect_prev;
+    }
+    else {
+        loop->connect_tail = conn->connect_prev;
+    }
+}
+
+/*
+ * expire_connects: Close the connections that are still connecting after
+ *      the connect timeout
+ * 
+ * return milliseconds until the next one is due, -1 if there is none
+ */
+int 
+expire_connects(event_loop *loop) {
+    long now = now_msec();
+    
+    while (loop->connect_head != NULL) {
+        if (loop->connect_head->connect_deadline > now) {
+            return (int)(loop->connect_head->connect_deadline - now);
+        }
+        close_conn(loop, loop->connect_head);
+    }
+    
+    return -1;
+}
+
+/*
+ * accept_conns: Accept all waiting connections and wait for their request
+ */
+void 
+accept_conns(event_loop *loop) {
+    int connfd;
+    event_conn *conn;
+    
+    while ((connfd = accept(loop->listenfd, NULL, NULL)) >= 0) {
+        if ((conn = (event_conn *)Malloc(sizeof(event_conn))) == NULL) {
+            close(connfd);
+            continue;
+        }
+        
+        conn->state = EVENT_REQUEST;
+        conn->client_fd = connfd;
+        conn->server_fd = -1;
+        conn->client_wait = 0;
+        init_http_buf(&conn->request, conn->request_storage, 
+        sizeof(conn->request_storage));
+        conn->host = NULL;
+        conn->uri = NULL;
+        init_http_buf(&conn->upstream, conn->upstream_storage, 
+        sizeof(conn->upstream_storage));
+        conn->upstream_sent = 0;
+        conn->buffer = NULL;
+        conn->buffer_len = 0;
+        conn->buffer_sent = 0;
+        conn->content = NULL;
+        conn->content_len = 0;
+        conn->content_size = 0;
+        conn->block = NULL;
+        conn->block_sent = 0;
+        
+        set_nonblocking(connfd);
+        track_fd(loop, connfd, conn);
+        watch_fd(loop, connfd, EPOLL_CTL_ADD, EPOLLIN);
+    }
+}
+
+/*
+ * close_conn: Close both sockets of the connection (closing removes them
+ *      from epoll) and free everything it holds
+ */
+void 
+close_conn(event_loop *loop, event_conn *conn) {
+    track_fd(loop, conn->client_fd, NULL);
+    close(conn->client_fd);
+    
+    if (conn->server_fd >= 0) {
+        track_fd(loop, conn->server_fd, NULL);
+        close(conn->server_fd);
+    }
+    if (conn->state == EVENT_CONNECT) {
+        stop_connect_timer(loop, conn);
+    }
+    
+    if (conn->block != NULL) {
+        unpin_cache(loop->cache, conn->block);
+    }
+    if (conn->content != NULL) {
+        Free(conn->content);
+    }
+    if (conn->buffer != NULL) {
+        Free(conn->buffer);
+    }
+    if (conn->host != NULL) {
+        Free(conn->host);
+    }
+    free_http_buf(&conn->request);
+    free_http_buf(&conn->upstream);
+    Free(conn);
+}
+
+/*
+ * client_event: Client socket is ready, continue the state we are in
+ */
+void 
+client_event(event_loop *loop, event_conn *conn, unsigned int events) {
+    /* Client is gone */
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_conn(loop, conn);
+        return;
+    }
+    
+    if (conn->state == EVENT_REQUEST) {
+        read_request(loop, conn);
+    }
+    else if (conn->state == EVENT_CACHED) {
+        send_cached(loop, conn);
+    }
+    else if (conn->state == EVENT_RELAY) {
+        send_response(loop, conn);
+    }
+}
+
+/*
+ * server_event: Server socket is ready, continue the state we are in
+ */
+void 
+server_event(event_loop *loop, event_conn *conn, unsigned int events) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    
+    if (conn->state == EVENT_CONNECT) {
+        /* Check if the connection succeeded */
+        if (getsockopt(conn->server_fd, SOL_SOCKET, SO_ERROR, 
+        &error, &error_len) < 0 || error != 0) {
+            close_conn(loop, conn);
+            return;
+        }
+        
+        stop_connect_timer(loop, conn);
+        conn->state = EVENT_FORWARD;
+        send_request(loop, conn);
+    }
+    else if (conn->state == EVENT_FORWARD) {
+        send_request(loop, conn);
+    }
+    else if (conn->state == EVENT_RELAY) {
+        /* Hang up still has to be read to the end */
+        read_response(loop, conn);
+    }
+}
+
+/*
+ * read_request: Read client request until the empty line. The request is
+ *      dropped if it is larger than REQUEST_HEADER_MAX.
+ */
+void 
+read_request(event_loop *loop, event_conn *conn) {
+    char data[MAXBUF];
+    ssize_t read_len;
+    size_t search_from;
+    
+    while (1) {
+        read_len = read(conn->client_fd, data, sizeof(data));
+        
+        if (read_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        
+        if (read_len == 0) { /* Client closed before the end of request */
+            close_conn(loop, conn);
+            return;
+        }
+        
+        /* Too big */
+        if (conn->request.len + read_len > REQUEST_HEADER_MAX || 
+        http_buf_append(&conn->request, data, read_len) < 0) {
+            close_conn(loop, conn);
+            return;
+        }
+        
+        /* The end may be split between reads */
+        search_from = conn->request.len - read_len;
+        search_from = (search_from > 3) ? search_from - 3 : 0;
+        if (strstr(conn->request.data + search_from, "\r\n\r\n") != NULL) {
+            start_request(loop, conn);
+            return;
+        }
+    }
+}
+
+/*
+ * start_request: Parse client request. Serve it from cache if possible,
+ *      otherwise build the request to the remote server and connect to it.
+ *      Like doit(), only GET request is handled.
+ */
+void 
+start_request(event_loop *loop, event_conn *conn) {
+    /* Parameter obtain by parsing client request */
+    char method[METHOD_SIZE];
+    char protocol[PROTOCOL_SIZE]; /* for future use */
+    char port[PORT_SIZE];
+    char version[VERSION_SIZE];
+    char host[HOST_SIZE];
+    char uri[MAXLINE];
+    char *line_end, *headers;
+    
+    /* Split request line and headers, uri must have room for the line */
+    line_end = strstr(conn->request.data, "\r\n");
+    *line_end = '\0';
+    headers = line_end + 2;
+    
+    if (line_end - conn->request.data >= MAXLINE || 
+    parse_request(conn->request.data, 
+    method, protocol, host, uri, port, version) == -1 || 
+    strcasecmp(method, "GET")) {
+        close_conn(loop, conn);
+        return;
+    }
+    
+    /* Cache hit, send it when client is ready */
+    if ((conn->block = pin_cache(loop->cache, host, uri)) != NULL) {
+        conn->state = EVENT_CACHED;
+        watch_fd(loop, conn->client_fd, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+    }
+    
+    /* Construct request line and header lines */
+    http_buf_puts(&conn->upstream, method);
+    http_buf_puts(&conn->upstream, " ");
+    http_buf_puts(&conn->upstream, uri);
+    http_buf_puts(&conn->upstream, " ");
+    http_buf_puts(&conn->upstream, version);
+    http_buf_puts(&conn->upstream, "\r\n");
+    if (build_request_header(headers, host, port, &conn->upstream, 0, 
+    NULL, NULL) < 0 || 
+    (loop->cache != NULL && keep_key(conn, host, uri) < 0)) {
+        close_conn(loop, conn);
+        return;
+    }
+    
+    /* Client request is all in upstream now */
+    free_http_buf(&conn->request);
+    init_http_buf(&conn->request, conn->request_storage, 
+    sizeof(conn->request_storage));
+    
+    /* Can't connect to server */
+    if ((conn->server_fd = connect_server(loop, host, port)) < 0) {
+        close_conn(loop, conn);
+        return;
+    }
+    
+    /* Nothing to do with client until the response comes */
+    conn->state = EVENT_CONNECT;
+    start_connect_timer(loop, conn);
+    track_fd(loop, conn->server_fd, conn);
+    watch_fd(loop, conn->client_fd, EPOLL_CTL_MOD, 0);
+    watch_fd(loop, conn->server_fd, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+/*
+ * keep_key: Copy host and uri to the connection for writing the response
+ *      to cache, both in one allocation
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+keep_key(event_conn *conn, char *host, char *uri) {
+    size_t host_len = strlen(host) + 1;
+    size_t uri_len = strlen(uri) + 1;
+    
+    if ((conn->host = (char *)Malloc(host_len + uri_len)) == NULL) {
+        return -1;
+    }
+    conn->uri = conn->host + host_len;
+    memcpy(conn->host, host, host_len);
+    memcpy(conn->uri, uri, uri_len);
+    
+    return 0;
+}
+
+/*
+ * send_cached: Send the pinned block to client, close when done
+ */
+void 
+send_cached(event_loop *loop, event_conn *conn) {
+    ssize_t write_len;
+    
+    while (conn->block_sent < conn->block->payload_size) {
+        write_len = write(conn->client_fd, 
+        (char *)conn->block->payload + conn->block_sent, 
+        conn->block->payload_size - conn->block_sent);
+        
+        if (write_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->block_sent += write_len;
+    }
+    
+    close_conn(loop, conn);
+}
+
+/*
+ * send_request: Send the request to the remote server, then wait for
+ *      the response
+ */
+void 
+send_request(event_loop *loop, event_conn *conn) {
+    ssize_t write_len;
+    
+    while (conn->upstream_sent < conn->upstream.len) {
+        write_len = write(conn->server_fd, 
+        conn->upstream.data + conn->upstream_sent, 
+        conn->upstream.len - conn->upstream_sent);
+        
+        if (write_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->upstream_sent += write_len;
+    }
+    
+    /* Relay buffer is only needed from now on */
+    if ((conn->buffer = (char *)Malloc(MAXBUF)) == NULL) {
+        close_conn(loop, conn);
+        return;
+    }
+    
+    conn->state = EVENT_RELAY;
+    watch_fd(loop, conn->server_fd, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * read_response: Read the response from server and relay it to client
+ *      until client can't take more or the server has nothing more now.
+ *      The response ends when the server closes the connection.
+ */
+void 
+read_response(event_loop *loop, event_conn *conn) {
+    ssize_t read_len;
+    
+    while (1) {
+        read_len = read(conn->server_fd, conn->buffer, MAXBUF);
+        
+        if (read_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        
+        if (read_len == 0) {
+            finish_response(loop, conn);
+            return;
+        }
+        
+        keep_content(loop, conn, conn->buffer, read_len);
+        conn->buffer_len = read_len;
+        conn->buffer_sent = 0;
+        
+        /* Stop if client is slow or gone */
+        if (send_response(loop, conn) <= 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * send_response: Send the relay buffer to client. If client can't take it
+ *      all, wait for client and stop reading the server, and the other
+ *      way around when the buffer is empty again.
+ * 
+ * return 1 = buffer is sent, 0 = waiting for client,
+ *      -1 = error (connection is closed)
+ */
+int 
+send_response(event_loop *loop, event_conn *conn) {
+    ssize_t write_len;
+    
+    while (conn->buffer_sent < conn->buffer_len) {
+        write_len = write(conn->client_fd, 
+        conn->buffer + conn->buffer_sent, 
+        conn->buffer_len - conn->buffer_sent);
+        
+        if (write_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+                return -1;
+            }
+            
+            /* Server hang up is reported even with no events, take the
+             * server out of epoll while we wait */
+            if (!conn->client_wait) {
+                conn->client_wait = 1;
+                watch_fd(loop, conn->client_fd, EPOLL_CTL_MOD, EPOLLOUT);
+                watch_fd(loop, conn->server_fd, EPOLL_CTL_DEL, 0);
+            }
+            return 0;
+        }
+        conn->buffer_sent += write_len;
+    }
+    
+    conn->buffer_len = 0;
+    conn->buffer_sent = 0;
+    
+    if (conn->client_wait) {
+        conn->client_wait = 0;
+        watch_fd(loop, conn->client_fd, EPOLL_CTL_MOD, 0);
+        watch_fd(loop, conn->server_fd, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    
+    return 1;
+}
+
+/*
+ * keep_content: Accumulate the response for the cache while it still fits
+ *      in an object and keep track of total response size. The buffer
+ *      grows as the response comes and is dropped once it's too big.
+ */
+void 
+keep_content(event_loop *loop, event_conn *conn, char *data, int len) {
+    char *content;
+    long size;
+    
+    if (loop->cache == NULL) {
+        return;
+    }
+    
+    /* Content is NULL after the first byte only if it was dropped */
+    if ((conn->content != NULL || conn->content_len == 0) && 
+    conn->content_len + len <= loop->cache->max_object_size) {
+        if (conn->content_len + len > conn->content_size) {
+            size = (conn->content_size > 0) ? conn->content_size : MAXBUF;
+            while (size < conn->content_len + len) {
+                size *= 2;
+            }
+            if (size > loop->cache->max_object_size) {
+                size = loop->cache->max_object_size;
+            }
+            
+            if ((content = (char *)Realloc(conn->content, size)) == NULL) {
+                Free(conn->content);
+                conn->content = NULL;
+                conn->content_len += len;
+                return;
+            }
+            conn->content = content;
+            conn->content_size = size;
+        }
+        
+        memcpy(conn->content + conn->content_len, data, len);
+    }
+    else if (conn->content != NULL) {
+        Free(conn->content);
+        conn->content = NULL;
+    }
+    
+    conn->content_len += len;
+}
+
+/*
+ * finish_response: Server is done and client has everything. Write the
+ *      response to cache if it is not too big and close.
+ */
+void 
+finish_response(event_loop *loop, event_conn *conn) {
+    http_response response;
+    int ttl;
+    
+    if (loop->cache != NULL) {
+        count_miss_bytes(loop->cache, conn->host, conn->uri, 
+        conn->content_len);
+        
+        /* Only if its headers let it be cached */
+        if (conn->content != NULL && 
+        parse_response_headers(conn->content, conn->content_len, 
+        &response) > 0 && 
+        (ttl = response_ttl(&response, loop->cache->default_ttl)) > 0) {
+            write_cache(loop->cache, conn->host, conn->uri, 
+            conn->content, conn->content_len, ttl, response.etag, 
+            response.last_modified);
+        }
+    }
+    
+    close_conn(loop, conn);
+}
@@ -0,0 +1,111 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * event.h: header file for the event driven mode of the proxy
+ *     One thread serves all connections with non-blocking sockets and epoll
+ *     instead of one thread per connection. Each connection is a state
+ *     machine that moves on when its sockets are ready:
+ *     - EVENT_REQUEST: read client request until the empty line
+ *     - EVENT_CACHED: send the cached object to client
+ *     - EVENT_CONNECT: wait for the connection to the remote server
+ *     - EVENT_FORWARD: send the request to the remote server
+ *     - EVENT_RELAY: relay the response from server to client
+ *     The relay reads from the server only when client has taken all data
+ *     read so far, so a slow client never makes the proxy buffer more than
+ *     MAXBUF bytes of its response.
+ * 
+ * Cache: Hits are served with pin_cache() and misses are written with
+ *     write_cache() after the response ends. The loop never waits for the
+ *     cache, so it doesn't join a request that is filling the same object
+ *     (see lookup_cache() in cache.h), the object is fetched again.
+ * 
+ * Connect: The connections to the remote servers are started without
+ *     blocking and listed in the order they started. A connection still
+ *     not done after the connect timeout (-n) is closed, epoll_wait()
+ *     only sleeps until the first of them is due.
+ * 
+ * Memory: A connection only keeps small buffers for the request from
+ *     client and the request to the server, they grow on the heap for
+ *     large headers (up to REQUEST_HEADER_MAX). The relay buffer is taken
+ *     when the response starts and host and uri are kept only on a cache
+ *     miss, so an idle connection costs a few KB.
+ * 
+ * Limit: Looking up the remote server still blocks the loop when it's not in
+ *     the resolver cache (see dns.h). Only the first address that starts
+ *     connecting is used, there is no race as in connect.h.
+ */
+
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "dns.h"
+#include <sys/epoll.h>
+
+#define EVENT_MAX_EVENTS 256 /* Events taken per epoll_wait() */
+#define EVENT_STORAGE_SIZE 1024 /* Bytes of each request kept in the conn */
+
+/* Connection states */
+#define EVENT_REQUEST 0
+#define EVENT_CACHED 1
+#define EVENT_CONNECT 2
+#define EVENT_FORWARD 3
+#define EVENT_RELAY 4
+
+typedef struct event_conn {
+    int state;
+    int client_fd;
+    int server_fd; /* -1 until we connect to the remote server */
+    int client_wait; /* 1 = waiting for client to take the relay buffer */
+    
+    /* Client request */
+    char request_storage[EVENT_STORAGE_SIZE];
+    http_buf request;
+    char *host; /* NULL unless the response may be cached */
+    char *uri;
+    
+    /* Request to the remote server */
+    char upstream_storage[EVENT_STORAGE_SIZE];
+    http_buf upstream;
+    size_t upstream_sent;
+    
+    /* Connections still connecting, in the order they started */
+    long connect_deadline; /* Milliseconds */
+    struct event_conn *connect_prev;
+    struct event_conn *connect_next;
+    
+    /* Response relay, NULL until the response starts */
+    char *buffer;
+    int buffer_len;
+    int buffer_sent;
+    
+    /* Response kept for the cache, NULL once it's too big */
+    char *content;
+    long content_len; /* Total response size, may pass the object size */
+    long content_size; /* Size of content */
+    
+    /* Pinned block if cache hit */
+    cache_block *block;
+    int block_sent;
+} event_conn;
+
+typedef struct event_loop {
+    int epfd;
+    int listenfd;
+    proxy_cache *cache; /* NULL if cache is disabled */
+    dns_cache *dns; /* NULL if resolver cache is disabled */
+    event_conn **conns; /* Connection of each fd (client and server) */
+    int conn_size; /* Size of conns */
+    int connect_timeout; /* Milliseconds */
+    event_conn *connect_head; /* First connection to time out */
+    event_conn *connect_tail;
+} event_loop;
+
+/* Functions used in proxy.c */
+void run_event_loop(int listenfd, proxy_cache *my_cache, dns_cache *dns, 
+int connect_timeout);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,1040 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * http.c: implementation of http.h, request line parsing, request header
+ *      rewriting and response framing
+ */
+
+#define _GNU_SOURCE /* strcasestr, strptime and timegm */
+#include "http.h"
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+/* You won't lose style points for including these long lines in your code */
+/* Default value for required headers */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+
+/* Additional header string */
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+
+/* Default protocol and port */
+static const char *default_protocol = "http";
+static const char *default_port = "80";
+
+/* Request headers we rewrite or look at, see header_type() */
+#define HEADER_OTHER 0
+#define HEADER_END 1 /* The empty line */
+#define HEADER_HOST 2
+#define HEADER_USER_AGENT 3
+#define HEADER_ACCEPT 4
+#define HEADER_ACCEPT_ENCODING 5
+#define HEADER_CONNECTION 6
+#define HEADER_PROXY_CONNECTION 7
+#define HEADER_IF_NONE_MATCH 8
+#define HEADER_IF_MODIFIED_SINCE 9
+#define HEADER_CONTENT_LENGTH 10
+#define HEADER_TRANSFER_ENCODING 11
+
+/* Force using HTTP/1.0 version (set to 1 if want to use HTTP/1.0)*/
+static int use_old_version = 1;
+
+/* Helper functions */
+static int is_line_end(char c);
+static int is_field_end(char c);
+static int skip_spaces(const char *line, int i, int len);
+static void copy_view(char *dst, const char *line, http_view view);
+static int header_type(const char *line, size_t len);
+static int has_token(const char *line, size_t len, const char *token);
+static void parse_cache_control(char *value, http_response *response);
+static long parse_seconds(char *value);
+static time_t parse_http_date(char *value);
+static void copy_validator(char *dst, char *value);
+static int etag_match(char *list, char *etag);
+
+/* Functions */
+
+/*
+ * parse_request_line: split the request line from client METHOD URL VERSION
+ *      in one pass into views of line, nothing is copied. The line ends at
+ *      CR, LF, NUL or after len bytes, fields are separated by spaces or tabs.
+ *      The url is [scheme://]host[:port][/path], the scheme is only taken if
+ *      it is made of scheme characters.
+ * 
+ * return 1 = success, -1 = error (no method or host, version without '/'
+ *      or port over 65535)
+ */
+int 
+parse_request_line(const char *line, int len, http_request_line *request) {
+    int i = 0;
+    int scheme_only = 1; /* 1 = first part of url has only scheme chars */
+    int version_ok = 0; /* 1 = version has '/' */
+    char c;
+    
+    memset(request, 0, sizeof(*request));
+    
+    /* Method */
+    i = skip_spaces(line, i, len);
+    request->method.off = i;
+    while (i < len && !is_field_end(line[i])) {
+        i++;
+    }
+    request->method.len = i - request->method.off;
+    i = skip_spaces(line, i, len);
+    
+    /* Scheme or host, it is the scheme if "://" follows */
+    request->host.off = i;
+    while (i < len && (c = line[i]) != ':' && c != '/' && !is_field_end(c)) {
+        if (!isalnum((unsigned char)c) && c != '+' && c != '-' && c != '.') {
+            scheme_only = 0;
+        }
+        i++;
+    }
+    if (scheme_only && i > request->host.off && len - i >= 3 && 
+    !memcmp(line + i, "://", 3)) {
+        request->scheme.off = request->host.off;
+        request->scheme.len = i - request->host.off;
+        i += 3;
+        
+        /* Host */
+        request->host.off = i;
+        while (i < len && (c = line[i]) != ':' && c != '/' && 
+        !is_field_end(c)) {
+            i++;
+        }
+    }
+    request->host.len = i - request->host.off;
+    
+    /* Port, the number is taken from its leading digits */
+    if (i < len && line[i] == ':') {
+        request->port.off = ++i;
+        while (i < len && line[i] >= '0' && line[i] <= '9') {
+            request->port_number = request->port_number * 10 + line[i] - '0';
+            if (request->port_number > 65535) {
+                return -1;
+            }
+            i++;
+        }
+        while (i < len && line[i] != '/' && !is_field_end(line[i])) {
+            i++;
+        }
+        request->port.len = i - request->port.off;
+    }
+    
+    /* Path, the rest of url */
+    request->path.off = i;
+    while (i < len && !is_field_end(line[i])) {
+        i++;
+    }
+    request->path.len = i - request->path.off;
+    i = skip_spaces(line, i, len);
+    
+    /* Version */
+    request->version.off = i;
+    while (i < len && !is_field_end(line[i])) {
+        if (line[i] == '/') {
+            version_ok = 1;
+        }
+        i++;
+    }
+    request->version.len = i - request->version.off;
+    
+    while (i < len && !is_line_end(line[i])) {
+        i++;
+    }
+    request->len = i;
+    
+    if (request->method.len == 0 || request->host.len == 0 || !version_ok) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * parse_request: parse the request from client from METHOD URL VERSION 
+ *      into small components used to construct the request line.
+ *      The views from parse_request_line() are copied out with the default
+ *      protocol, port and uri when url has none of them. uri must have
+ *      room for the line, method, protocol, host, port and ver for
+ *      METHOD_SIZE, PROTOCOL_SIZE, HOST_SIZE, PORT_SIZE and VERSION_SIZE
+ *      bytes.
+ * 
+ * return 1 = success, -1 = error (or a small field is too long)
+ */
+int 
+parse_request(char *req, char *method, 
+char *protocol, char *host, char *uri, char *port, char *ver) {
+    http_request_line request;
+    
+    if (parse_request_line(req, strlen(req), &request) == -1 || 
+    request.method.len >= METHOD_SIZE || 
+    request.scheme.len >= PROTOCOL_SIZE || 
+    request.host.len >= HOST_SIZE || 
+    (!use_old_version && request.version.len >= VERSION_SIZE)) {
+        return -1;
+    }
+    
+    copy_view(method, req, request.method);
+    copy_view(host, req, request.host);
+    
+    /* Apply default protocol, uri and port */
+    if (request.scheme.len > 0) {
+        copy_view(protocol, req, request.scheme);
+    }
+    else {
+        strcpy(protocol, default_protocol);
+    }
+    if (request.path.len > 0) {
+        copy_view(uri, req, request.path);
+    }
+    else {
+        strcpy(uri, "/");
+    }
+    if (request.port_number > 0) {
+        sprintf(port, "%d", request.port_number);
+    }
+    else {
+        strcpy(port, default_port);
+    }
+    
+    /* Force using HTTP/1.0 if desired */
+    if (use_old_version) {
+        strcpy(ver, "HTTP/1.0");
+    }
+    else {
+        copy_view(ver, req, request.version);
+    }
+    
+    return 1;
+}
+
+/*
+ * init_http_buf: start an empty buffer in storage of size bytes given by
+ *      the caller, it moves to the heap if more is appended
+ */
+void 
+init_http_buf(http_buf *buf, char *storage, size_t size) {
+    buf->data = storage;
+    buf->len = 0;
+    buf->size = size;
+    buf->on_heap = 0;
+    buf->error = 0;
+    buf->data[0] = '\0';
+}
+
+/*
+ * http_buf_append: write len bytes of data at the cursor, the buffer is
+ *      doubled until they fit (and the ending '\0'). If there is no memory
+ *      for them, buf->error is set and nothing more is appended.
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+http_buf_append(http_buf *buf, const char *data, size_t len) {
+    size_t size = buf->size;
+    char *new_data;
+    
+    if (buf->error || len > (SIZE_MAX >> 2) - buf->len) {
+        buf->error = 1;
+        return -1;
+    }
+    
+    if (buf->len + len >= size) {
+        while (buf->len + len >= size) {
+            size *= 2;
+        }
+        if (buf->on_heap) {
+            new_data = Realloc(buf->data, size);
+        }
+        else if ((new_data = Malloc(size)) != NULL) {
+            memcpy(new_data, buf->data, buf->len);
+        }
+        
+        /* The old data is still there (and freed by free_http_buf()) */
+        if (new_data == NULL) {
+            buf->error = 1;
+            return -1;
+        }
+        buf->data = new_data;
+        buf->size = size;
+        buf->on_heap = 1;
+    }
+    
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    
+    return 0;
+}
+
+/*
+ * http_buf_puts: write string str at the cursor
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+http_buf_puts(http_buf *buf, const char *str) {
+    return http_buf_append(buf, str, strlen(str));
+}
+
+/*
+ * free_http_buf: free the heap memory of buf, if it has moved there
+ */
+void 
+free_http_buf(http_buf *buf) {
+    if (buf->on_heap) {
+        Free(buf->data);
+        buf->on_heap = 0;
+    }
+}
+
+/*
+ * build_request_header: scanning the headers from client to filter the
+ *      headers. client_header holds the header lines (each ends with \n)
+ *      up to the empty line or the end of string. All of required header
+ *      (Host, User-Agent, Accept, Accept-Encoding, Connection and
+ *      Proxy-Connection) will be modified to default value. Other headers
+ *      from client will be forwarded normally. If keep_alive is set, the
+ *      remote server is asked to keep the connection open. If etag or
+ *      last_modified is not NULL, the request checks our stale copy: they
+ *      are sent in If-None-Match and If-Modified-Since instead of the
+ *      conditions of client. The headers are appended to request, each
+ *      line is looked at and copied once.
+ * 
+ * return 0 = success, -1 = no memory for the headers
+ */
+int 
+build_request_header(char *client_header, char *host, char *port, 
+http_buf *request, int keep_alive, char *etag, char *last_modified) {
+    int revalidate = (etag != NULL || last_modified != NULL);
+    
+    /* Header provided by client */
+    int host_hdr = 0;
+    int user_agent = 0;
+    int accept = 0;
+    int accept_encoding = 0;
+    int connection = 0;
+    int proxy_connection = 0;
+    char *line_end;
+    size_t line_len;
+    int type;
+    
+    /* Keep reading headers from client until we reach the empty line */
+    while (*client_header != '\0') {
+        /* Take one line */
+        if ((line_end = strchr(client_header, '\n')) != NULL) {
+            line_len = line_end - client_header + 1;
+        }
+        else {
+            line_len = strlen(client_header);
+        }
+        
+        /* According to RFC 2616, the sequence of header doesn't matter */
+        type = header_type(client_header, line_len);
+        if (type == HEADER_END) {
+            break;
+        }
+        else if (type == HEADER_HOST) {
+            http_buf_append(request, client_header, line_len);
+            host_hdr = 1;
+        }
+        else if (type == HEADER_USER_AGENT) {
+            http_buf_puts(request, user_agent_hdr);
+            user_agent = 1;
+        }
+        else if (type == HEADER_ACCEPT_ENCODING) {
+            http_buf_puts(request, accept_encoding_hdr);
+            accept_encoding = 1;
+        }
+        else if (type == HEADER_ACCEPT) {
+            http_buf_puts(request, accept_hdr);
+            accept = 1;
+        }
+        else if (type == HEADER_PROXY_CONNECTION) {
+            http_buf_puts(request, proxy_connection_hdr);
+            proxy_connection = 1;
+        }
+        else if (type == HEADER_CONNECTION) {
+            http_buf_puts(request, 
+            keep_alive ? keep_alive_hdr : connection_hdr);
+            connection = 1;
+        }
+        else if (revalidate && (type == HEADER_IF_NONE_MATCH || 
+        type == HEADER_IF_MODIFIED_SINCE)) {
+            /* Our validators replace them */
+        }
+        else { /* Other types of header tht is not mentioned in the writeup*/
+            http_buf_append(request, client_header, line_len);
+        }
+        client_header += line_len;
+    }
+    
+    /* Add the missing required header */
+    /* Host */
+    if(!host_hdr) {
+        http_buf_puts(request, "Host: ");
+        http_buf_puts(request, host);
+        http_buf_puts(request, ":");
+        http_buf_puts(request, port);
+        http_buf_puts(request, "\r\n");
+    }
+    /* User-Agent */
+    if (!user_agent) {
+        http_buf_puts(request, user_agent_hdr);
+    }
+    /* Accept-Enconding */
+    if (!accept_encoding) {
+        http_buf_puts(request, accept_encoding_hdr);
+    }
+    /* Accept */
+    if (!accept) {
+        http_buf_puts(request, accept_hdr);
+    }
+    /* Proxy-Connection */
+    if (!proxy_connection) {
+        http_buf_puts(request, proxy_connection_hdr);
+    }
+    /* Connection */
+    if (!connection) {
+        http_buf_puts(request, keep_alive ? keep_alive_hdr : connection_hdr);
+    }
+    /* Validators of our stale copy */
+    if (etag != NULL) {
+        http_buf_puts(request, "If-None-Match: ");
+        http_buf_puts(request, etag);
+        http_buf_puts(request, "\r\n");
+    }
+    if (last_modified != NULL) {
+        http_buf_puts(request, "If-Modified-Since: ");
+        http_buf_puts(request, last_modified);
+        http_buf_puts(request, "\r\n");
+    }
+    /*  End header lines with \r\n */
+    http_buf_puts(request, "\r\n");
+    
+    return request->error ? -1 : 0;
+}
+
+/*
+ * parse_status_line: Start reading a response from its status line. 
+ *      HTTP/1.1 keeps the connection by default, HTTP/1.0 doesn't.
+ * 
+ * return 1 = success, -1 = error
+ */
+int 
+parse_status_line(char *line, http_response *response) {
+    int minor;
+    
+    /* Read until close if the status line is broken */
+    response->status = 0;
+    response->keep_alive = 0;
+    response->chunked = 0;
+    response->content_length = -1;
+    response->framing = BODY_CLOSE;
+    response->no_store = 0;
+    response->no_cache = 0;
+    response->max_age = -1;
+    response->s_maxage = -1;
+    response->age = 0;
+    response->expires = -1;
+    response->date = -1;
+    response->etag[0] = '\0';
+    response->last_modified[0] = '\0';
+    
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &response->status) != 2) {
+        return -1;
+    }
+    
+    response->keep_alive = (minor >= 1);
+    
+    return 1;
+}
+
+/*
+ * parse_response_header: Read the framing, connection, freshness and
+ *      validator headers of a response. Connection, Keep-Alive and
+ *      Transfer-Encoding are about the connection to the remote server
+ *      (hop-by-hop), not about the object, so they are not forwarded to
+ *      client.
+ * 
+ * return 1 = forward the header, 0 = drop it
+ */
+int 
+parse_response_header(char *line, http_response *response) {
+    if (!strncasecmp(line, "Content-Length:", 15)) {
+        response->content_length = atol(line + 15);
+    }
+    else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+        response->chunked = (strcasestr(line + 18, "chunked") != NULL);
+        return 0;
+    }
+    else if (!strncasecmp(line, "Connection:", 11)) {
+        if (strcasestr(line + 11, "close") != NULL) {
+            response->keep_alive = 0;
+        }
+        else if (strcasestr(line + 11, "keep-alive") != NULL) {
+            response->keep_alive = 1;
+        }
+        return 0;
+    }
+    else if (!strncasecmp(line, "Keep-Alive:", 11) || 
+    !strncasecmp(line, "Proxy-Connection:", 17)) {
+        return 0;
+    }
+    else if (!strncasecmp(line, "Cache-Control:", 14)) {
+        parse_cache_control(line + 14, response);
+    }
+    else if (!strncasecmp(line, "Expires:", 8)) {
+        response->expires = parse_http_date(line + 8);
+    }
+    else if (!strncasecmp(line, "Date:", 5)) {
+        if ((response->date = parse_http_date(line + 5)) == 0) {
+            response->date = -1;
+        }
+    }
+    else if (!strncasecmp(line, "Age:", 4)) {
+        response->age = atol(line + 4);
+    }
+    else if (!strncasecmp(line, "ETag:", 5)) {
+        copy_validator(response->etag, line + 5);
+    }
+    else if (!strncasecmp(line, "Last-Modified:", 14)) {
+        copy_validator(response->last_modified, line + 14);
+    }
+    
+    return 1;
+}
+
+/*
+ * end_response_header: All headers are read, decide how the body ends
+ *      (RFC 7230 section 3.3.3). A response that ends when the server
+ *      closes can't keep the connection.
+ */
+void 
+end_response_header(http_response *response) {
+    if ((response->status >= 100 && response->status < 200) || 
+    response->status == 204 || response->status == 304) {
+        response->framing = BODY_NONE;
+    }
+    else if (response->chunked) {
+        response->framing = BODY_CHUNKED;
+    }
+    else if (response->content_length >= 0) {
+        response->framing = BODY_LENGTH;
+    }
+    else {
+        response->framing = BODY_CLOSE;
+        response->keep_alive = 0;
+    }
+}
+
+/*
+ * request_keep_alive: Decide from the request line and headers whether
+ *      client wants to send more requests on the connection. HTTP/1.1
+ *      keeps the connection unless client says close, HTTP/1.0 only if
+ *      client asks for keep-alive. A request with a body never keeps it,
+ *      we don't read the body so it can't be told from the next request.
+ * 
+ * return 1 = keep the connection, 0 = close it
+ */
+int 
+request_keep_alive(char *request, char *client_header) {
+    char *line_ptr = client_header;
+    char *end_ptr;
+    int minor, keep_alive, type;
+    size_t line_len;
+    
+    if (sscanf(request, "%*s %*s HTTP/1.%d", &minor) != 1) {
+        return 0;
+    }
+    keep_alive = (minor >= 1);
+    
+    /* Check each header line in place */
+    while (*line_ptr != '\0') {
+        if ((end_ptr = strchr(line_ptr, '\n')) == NULL) {
+            end_ptr = line_ptr + strlen(line_ptr) - 1;
+        }
+        line_len = end_ptr - line_ptr + 1;
+        type = header_type(line_ptr, line_len);
+        
+        if (type == HEADER_END) {
+            break;
+        }
+        if (type == HEADER_CONNECTION || type == HEADER_PROXY_CONNECTION) {
+            if (has_token(line_ptr, line_len, "close")) {
+                return 0;
+            }
+            if (has_token(line_ptr, line_len, "keep-alive")) {
+                keep_alive = 1;
+            }
+        }
+        else if ((type == HEADER_CONTENT_LENGTH && atol(line_ptr + 15) != 0) || 
+        type == HEADER_TRANSFER_ENCODING) {
+            return 0;
+        }
+        line_ptr = end_ptr + 1;
+    }
+    
+    return keep_alive;
+}
+
+/*
+ * parse_response_headers: Read the status line and headers at the start of
+ *      a response we have stored (a cached object), see parse_status_line()
+ * 
+ * return length of the headers including the empty line, -1 if the headers
+ *      don't end in data
+ */
+int 
+parse_response_headers(char *data, int len, http_response *response) {
+    char header_line[MAXLINE];
+    char *line_ptr = data;
+    char *end_ptr;
+    int line_len;
+    
+    parse_status_line("", response);
+    
+    while ((end_ptr = memchr(line_ptr, '\n', data + len - line_ptr)) != NULL) {
+        line_len = end_ptr - line_ptr + 1;
+        
+        /* Empty line */
+        if (line_len <= 2 && line_ptr != data) {
+            end_response_header(response);
+            return end_ptr + 1 - data;
+        }
+        
+        /* Headers too long to check are kept as they are */
+        if (line_len < MAXLINE) {
+            memcpy(header_line, line_ptr, line_len);
+            header_line[line_len] = '\0';
+            
+            if (line_ptr == data) {
+                parse_status_line(header_line, response);
+            }
+            else {
+                parse_response_header(header_line, response);
+            }
+        }
+        line_ptr = end_ptr + 1;
+    }
+    
+    return -1;
+}
+
+/*
+ * response_ttl: How long a copy of the response stays fresh, from s-maxage,
+ *      max-age, Expires - Date (in this order) or default_ttl, minus its
+ *      Age. Only the status codes that are cacheable by default are cached.
+ * 
+ * return seconds, 0 = must not be cached
+ */
+int 
+response_ttl(http_response *response, int default_ttl) {
+    long lifetime;
+    int status = response->status;
+    
+    if (response->no_store || response->no_cache || 
+    (status != 200 && status != 203 && status != 300 && status != 301 && 
+    status != 404 && status != 410)) {
+        return 0;
+    }
+    
+    if (response->s_maxage >= 0) {
+        lifetime = response->s_maxage;
+    }
+    else if (response->max_age >= 0) {
+        lifetime = response->max_age;
+    }
+    else if (response->expires >= 0) {
+        lifetime = response->expires - 
+        (response->date >= 0 ? response->date : time(NULL));
+    }
+    else {
+        lifetime = default_ttl;
+    }
+    lifetime -= response->age;
+    
+    if (lifetime <= 0) {
+        return 0;
+    }
+    return lifetime > INT_MAX ? INT_MAX : (int)lifetime;
+}
+
+/*
+ * revalidated_ttl: How long the stored response stays fresh after the
+ *      server answered our conditional request with not_modified (304).
+ *      The freshness directives of the 304 replace the stored ones
+ *      (RFC 7234 section 4.3.4), its Date and Age start the new lifetime.
+ * 
+ * return seconds, 0 = stays stale
+ */
+int 
+revalidated_ttl(char *stored, int len, http_response *not_modified, 
+int default_ttl) {
+    http_response response;
+    
+    if (parse_response_headers(stored, len, &response) < 0) {
+        return 0;
+    }
+    
+    if (not_modified->no_store || not_modified->no_cache || 
+    not_modified->max_age >= 0 || not_modified->s_maxage >= 0) {
+        response.no_store = not_modified->no_store;
+        response.no_cache = not_modified->no_cache;
+        response.max_age = not_modified->max_age;
+        response.s_maxage = not_modified->s_maxage;
+    }
+    if (not_modified->expires != -1) {
+        response.expires = not_modified->expires;
+    }
+    response.date = not_modified->date;
+    response.age = not_modified->age;
+    
+    return response_ttl(&response, default_ttl);
+}
+
+/*
+ * request_not_modified: Check the conditions of client request against the
+ *      validators of a cached response (RFC 7232). If-None-Match is used if
+ *      client sends it (weak comparison, "*" matches any), otherwise
+ *      If-Modified-Since is compared with Last-Modified. etag and
+ *      last_modified are NULL if the response has none.
+ * 
+ * return 1 = answer 304 Not Modified, 0 = send the response
+ */
+int 
+request_not_modified(char *client_header, char *etag, char *last_modified) {
+    char *none_match = NULL;
+    char *modified_since = NULL;
+    char *line_end;
+    size_t line_len;
+    time_t since, modified;
+    int type;
+    
+    while (*client_header != '\0') {
+        if ((line_end = strchr(client_header, '\n')) != NULL) {
+            line_len = line_end - client_header + 1;
+        }
+        else {
+            line_len = strlen(client_header);
+        }
+        
+        type = header_type(client_header, line_len);
+        if (type == HEADER_END) {
+            break;
+        }
+        else if (type == HEADER_IF_NONE_MATCH) {
+            none_match = client_header + 14;
+        }
+        else if (type == HEADER_IF_MODIFIED_SINCE) {
+            modified_since = client_header + 18;
+        }
+        client_header += line_len;
+    }
+    
+    if (none_match != NULL) {
+        return (etag != NULL && etag_match(none_match, etag));
+    }
+    if (modified_since == NULL || last_modified == NULL) {
+        return 0;
+    }
+    
+    since = parse_http_date(modified_since);
+    modified = parse_http_date(last_modified);
+    return (since > 0 && modified > 0 && modified <= since);
+}
+
+/*
+ * end_client_header: Write the lines that end the response headers sent to
+ *      client into buf (Content-Length if the body has no framing but we
+ *      know body_len, Connection and the empty line). The connection is
+ *      kept only if client wants it and the end of the body can be told.
+ *      buf must hold CLIENT_HEADER_SIZE bytes.
+ * 
+ * return 1 = keep the connection, 0 = close it after the response
+ */
+int 
+end_client_header(char *buf, http_response *response, long body_len, 
+int keep_alive) {
+    int framed = (response->framing == BODY_NONE || 
+    response->framing == BODY_LENGTH);
+    
+    buf[0] = '\0';
+    if (!framed && body_len >= 0) {
+        sprintf(buf, "Content-Length: %ld\r\n", body_len);
+        framed = 1;
+    }
+    
+    keep_alive = (keep_alive && framed);
+    strcat(buf, keep_alive ? keep_alive_hdr : connection_hdr);
+    strcat(buf, "\r\n");
+    
+    return keep_alive;
+}
+
+/*
+ * is_line_end: tell if c ends the request line
+ */
+static int 
+is_line_end(char c) {
+    return c == '\r' || c == '\n' || c == '\0';
+}
+
+/*
+ * is_field_end: tell if c ends a field of the request line
+ */
+static int 
+is_field_end(char c) {
+    return c == ' ' || c == '\t' || is_line_end(c);
+}
+
+/*
+ * skip_spaces: return the index of the first character from i on that is
+ *      not a space or tab
+ */
+static int 
+skip_spaces(const char *line, int i, int len) {
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * copy_view: copy view of line into dst as a string, dst must have room for
+ *      view.len + 1 bytes
+ */
+static void 
+copy_view(char *dst, const char *line, http_view view) {
+    memcpy(dst, line + view.off, view.len);
+    dst[view.len] = '\0';
+}
+
+/*
+ * header_type: classify the header line of len bytes by its name, which is
+ *      compared without case only with the names of its length
+ * 
+ * return HEADER_*
+ */
+static int 
+header_type(const char *line, size_t len) {
+    const char *colon;
+    
+    if ((len == 2 && line[0] == '\r' && line[1] == '\n') || 
+    (len == 1 && line[0] == '\n')) {
+        return HEADER_END;
+    }
+    if ((colon = memchr(line, ':', len)) == NULL) {
+        return HEADER_OTHER;
+    }
+    
+    switch (colon - line) {
+    case 4:
+        if (!strncasecmp(line, "Host", 4)) {
+            return HEADER_HOST;
+        }
+        break;
+    case 6:
+        if (!strncasecmp(line, "Accept", 6)) {
+            return HEADER_ACCEPT;
+        }
+        break;
+    case 10:
+        if (!strncasecmp(line, "User-Agent", 10)) {
+            return HEADER_USER_AGENT;
+        }
+        if (!strncasecmp(line, "Connection", 10)) {
+            return HEADER_CONNECTION;
+        }
+        break;
+    case 13:
+        if (!strncasecmp(line, "If-None-Match", 13)) {
+            return HEADER_IF_NONE_MATCH;
+        }
+        break;
+    case 14:
+        if (!strncasecmp(line, "Content-Length", 14)) {
+            return HEADER_CONTENT_LENGTH;
+        }
+        break;
+    case 15:
+        if (!strncasecmp(line, "Accept-Encoding", 15)) {
+            return HEADER_ACCEPT_ENCODING;
+        }
+        break;
+    case 16:
+        if (!strncasecmp(line, "Proxy-Connection", 16)) {
+            return HEADER_PROXY_CONNECTION;
+        }
+        break;
+    case 17:
+        if (!strncasecmp(line, "If-Modified-Since", 17)) {
+            return HEADER_IF_MODIFIED_SINCE;
+        }
+        if (!strncasecmp(line, "Transfer-Encoding", 17)) {
+            return HEADER_TRANSFER_ENCODING;
+        }
+        break;
+    }
+    return HEADER_OTHER;
+}
+
+/*
+ * has_token: check if the comma separated value of the header line of len
+ *      bytes lists token (without case), items aren't copied
+ * 
+ * return 1 = listed, 0 = not listed
+ */
+static int 
+has_token(const char *line, size_t len, const char *token) {
+    const char *end = line + len;
+    const char *item;
+    size_t token_len = strlen(token);
+    
+    /* Value starts after the colon, header_type() found one */
+    line = (const char *)memchr(line, ':', len) + 1;
+    while (line < end) {
+        if (*line == ' ' || *line == '\t' || *line == ',' || 
+        *line == '\r' || *line == '\n') {
+            line++;
+            continue;
+        }
+        item = line;
+        while (line < end && *line != ' ' && *line != '\t' && 
+        *line != ',' && *line != '\r' && *line != '\n') {
+            line++;
+        }
+        if ((size_t)(line - item) == token_len && 
+        !strncasecmp(item, token, token_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * parse_cache_control: Read the directives of a Cache-Control value (up to
+ *      the end of line), unknown ones are ignored
+ */
+static void 
+parse_cache_control(char *value, http_response *response) {
+    char *end;
+    size_t len;
+    
+    while (*value != '\0' && *value != '\r' && *value != '\n') {
+        /* One directive, up to the next comma */
+        value += strspn(value, " \t,");
+        len = strcspn(value, " \t,=\r\n");
+        end = value + strcspn(value, ",\r\n");
+        
+        if ((len == 8 && !strncasecmp(value, "no-store", 8)) || 
+        (len == 7 && !strncasecmp(value, "private", 7))) {
+            response->no_store = 1;
+        }
+        else if (len == 8 && !strncasecmp(value, "no-cache", 8)) {
+            response->no_cache = 1;
+        }
+        else if (len == 7 && !strncasecmp(value, "max-age", 7)) {
+            response->max_age = parse_seconds(value + len);
+        }
+        else if (len == 8 && !strncasecmp(value, "s-maxage", 8)) {
+            response->s_maxage = parse_seconds(value + len);
+        }
+        value = end;
+    }
+}
+
+/*
+ * parse_seconds: Read the "=seconds" argument of a directive, a broken one
+ *      counts as 0 (already stale)
+ */
+static long 
+parse_seconds(char *value) {
+    value += strspn(value, " \t");
+    if (*value != '=') {
+        return 0;
+    }
+    value += 1 + (value[1] == '"');
+    return (*value >= '0' && *value <= '9') ? atol(value) : 0;
+}
+
+/*
+ * parse_http_date: Read an HTTP date (RFC 1123 format, always GMT)
+ * 
+ * return the time, 0 if it is not a valid date
+ */
+static time_t 
+parse_http_date(char *value) {
+    struct tm tm;
+    time_t date;
+    
+    memset(&tm, 0, sizeof(tm));
+    value += strspn(value, " \t");
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL || 
+    (date = timegm(&tm)) <= 0) {
+        return 0;
+    }
+    return date;
+}
+
+/*
+ * copy_validator: Copy a header value (without the spaces around it and the
+ *      line ending) to dst of VALIDATOR_SIZE bytes, "" if it doesn't fit
+ */
+static void 
+copy_validator(char *dst, char *value) {
+    size_t len;
+    
+    value += strspn(value, " \t");
+    len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+    
+    if (len >= VALIDATOR_SIZE) {
+        len = 0;
+    }
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+/*
+ * etag_match: Look for etag in the list of an If-None-Match value (up to the
+ *      end of line), weak tags (W/) match their strong form
+ * 
+ * return 1 = found or list is "*", 0 = not found
+ */
+static int 
+etag_match(char *list, char *etag) {
+    size_t len, etag_len;
+    
+    if (!strncmp(etag, "W/", 2)) {
+        etag += 2;
+    }
+    etag_len = strlen(etag);
+    
+    while (*list != '\0' && *list != '\r' && *list != '\n') {
+        /* One tag, up to the next comma */
+        list += strspn(list, " \t,");
+        len = strcspn(list, " \t,\r\n");
+        
+        if (len == 1 && *list == '*') {
+            return 1;
+        }
+        if (len > 2 && !strncmp(list, "W/", 2) && 
+        len - 2 == etag_len && !strncmp(list + 2, etag, etag_len)) {
+            return 1;
+        }
+        if (len == etag_len && !strncmp(list, etag, etag_len)) {
+            return 1;
+        }
+        list += len;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * http.h: header file for the HTTP request functions shared by the thread
+ *     and the event driven proxy (proxy.c and event.c)
+ *     parse_request_line() splits the request line in one pass into views
+ *     (offset and length) of the line without copying it, parse_request()
+ *     copies them out with the default values applied. build_request_header()
+ *     rewrites the client headers into the headers sent to the remote
+ *     server, appending them to an http_buf. The buffer starts in storage
+ *     of the caller and grows on the heap when a request has more headers
+ *     (large cookies) than fit there.
+ * 
+ * Response: parse_status_line(), parse_response_header() and
+ *     end_response_header() read the headers of a response from the remote
+ *     server into http_response, to know where its body ends (so the
+ *     connection can be used again) and which headers not to forward.
+ * 
+ * Freshness: parse_response_header() also reads Cache-Control, Expires,
+ *     Age and Date. response_ttl() turns them into the seconds a cached
+ *     copy stays fresh (RFC 7234), 0 if the response must not be cached:
+ *     no-store, private, no-cache, a status that is not cacheable or a
+ *     response already stale. default_ttl is used when the response has
+ *     no max-age and no Expires.
+ * 
+ * Validators: parse_response_header() keeps ETag and Last-Modified. They
+ *     are sent back to the server in If-None-Match and If-Modified-Since
+ *     by build_request_header() to revalidate a stale copy, and
+ *     revalidated_ttl() gives its new freshness when the server answers
+ *     304. request_not_modified() checks the same headers of a client
+ *     request against a cached copy, so the proxy can answer 304 itself.
+ * 
+ * Client connection: request_keep_alive() tells whether client sends more
+ *     requests on its connection. Responses are stored without the
+ *     Connection header, end_client_header() adds it (and Content-Length
+ *     when the body is otherwise only ended by close) for each client.
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* Most bytes of request headers read from client, 431 if there are more */
+#define REQUEST_HEADER_MAX 65536
+
+/* Size of the small fields written by parse_request() */
+#define METHOD_SIZE 16
+#define HOST_SIZE 256
+#define PROTOCOL_SIZE 16
+#define PORT_SIZE 8
+#define VERSION_SIZE 16
+
+/* Longest ETag or Last-Modified value kept, longer ones are dropped */
+#define VALIDATOR_SIZE 128
+
+/* Room for the lines written by end_client_header() */
+#define CLIENT_HEADER_SIZE 64
+
+/* How the response body ends */
+#define BODY_NONE 0 /* No body */
+#define BODY_LENGTH 1 /* After content_length bytes */
+#define BODY_CHUNKED 2 /* After the last chunk */
+#define BODY_CLOSE 3 /* When the server closes the connection */
+
+/* Part of a request line, len bytes starting at line + off */
+typedef struct http_view {
+    int off;
+    int len;
+} http_view;
+
+/* Request line "METHOD [scheme://]host[:port][/path] VERSION" */
+typedef struct http_request_line {
+    http_view method;
+    http_view scheme; /* len 0 if url has no scheme */
+    http_view host;
+    http_view port; /* len 0 if url has no port */
+    http_view path; /* len 0 if url has no path */
+    http_view version;
+    int port_number; /* 0 if port is empty or not a number */
+    int len; /* Length of the line without the line ending */
+} http_request_line;
+
+/* Growable buffer written at a cursor, starts in storage of the caller */
+typedef struct http_buf {
+    char *data; /* Always ends with '\0' */
+    size_t len; /* Write cursor */
+    size_t size;
+    int on_heap; /* 1 = data moved to the heap, see free_http_buf() */
+    int error; /* 1 = an append failed (no memory), the data is cut */
+} http_buf;
+
+typedef struct http_response {
+    int status;
+    int keep_alive; /* 1 = server keeps the connection open */
+    int chunked; /* 1 = Transfer-Encoding: chunked */
+    long content_length; /* -1 if unknown */
+    int framing; /* BODY_*, set by end_response_header() */
+    
+    /* Freshness, see response_ttl() */
+    int no_store; /* no-store or private */
+    int no_cache; /* no-cache, must be checked with the server first */
+    long max_age; /* -1 if none */
+    long s_maxage; /* -1 if none, overrides max-age in a shared cache */
+    long age; /* Age header, 0 if none */
+    time_t expires; /* -1 if none, 0 if not a valid date (stale) */
+    time_t date; /* -1 if none */
+    
+    /* Validators, "" if none */
+    char etag[VALIDATOR_SIZE];
+    char last_modified[VALIDATOR_SIZE];
+} http_response;
+
+/* Functions used in proxy.c and event.c */
+int parse_request_line(const char *line, int len, http_request_line *request);
+int parse_request(char *req, 
+char *method, char *protocol, char *host, char *uri, char *port, char *ver);
+void init_http_buf(http_buf *buf, char *storage, size_t size);
+int http_buf_append(http_buf *buf, const char *data, size_t len);
+int http_buf_puts(http_buf *buf, const char *str);
+void free_http_buf(http_buf *buf);
+int build_request_header(char *client_header, char *host, char *port, 
+http_buf *request, int keep_alive, char *etag, char *last_modified);
+int parse_status_line(char *line, http_response *response);
+int parse_response_header(char *line, http_response *response);
+void end_response_header(http_response *response);
+int request_keep_alive(char *request, char *client_header);
+int parse_response_headers(char *data, int len, http_response *response);
+int response_ttl(http_response *response, int default_ttl);
+int revalidated_ttl(char *stored, int len, http_response *not_modified, 
+int default_ttl);
+int request_not_modified(char *client_header, char *etag, 
+char *last_modified);
+int end_client_header(char *buf, http_response *response, long body_len, 
+int keep_alive);
+
+#endif /* __HTTP_H__ */
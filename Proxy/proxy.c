@@ -15,16 +15,56 @@
  *      response body that it will forward to the client.
  * 
  * Cache use: Cache is enable by default. To disable cache, type disable in
- *      <cache_status> when you run program: ./proxy <port> <cache_status>.
+ *      <cache_status> when you run program: 
+ *      ./proxy [options] <port> <cache_status>.
  *      
  *      The cache is maintained by using LRU eviction policy and implemented
  *      by using 2-way linked list (as same as explicit list in malloc lab).
  *      please see cache.h and cache.c for more detail.
+ *      Only responses the headers allow to be cached are stored (no
+ *      no-store, private or no-cache, a cacheable status), each stays fresh
+ *      for its max-age or Expires (-e if it has none), see response_ttl()
+ *      in http.h. A stale object is fetched again, with a conditional
+ *      request if it has an ETag or Last-Modified, so a 304 from the
+ *      server keeps the cached copy. Conditional requests of client are
+ *      answered with 304 from the cache (thread and pool mode).
+ * 
+ * Options:
+ *      -s <shards>  number of cache shards (default: number of cores)
+ *      -p <policy>  cache eviction policy: lru (default), clock or gdsf
+ *      -a <policy>  cache admission policy: all (default) or tinylfu
+ *      -r <seconds> print cache statistics every <seconds> seconds
+ *      -m <mode>    server mode: thread (default, one thread per connection),
+ *                   pool (prethreaded workers) or event (one thread with
+ *                   epoll, see event.h)
+ *      -w <workers> number of pool workers (default: 8 per core)
+ *      -q <depth>   pool connection queue depth (default: 256)
+ *      -o <policy>  pool queue overflow: block (default, stop accepting) or
+ *                   reject (reply 503 Service Unavailable)
+ *      -l <n>       open n SO_REUSEPORT listeners, each with its own
+ *                   acceptor thread (and its own event loop in event mode),
+ *                   e.g. one per core
+ *      -c           pin listener i to core i (with -l)
+ *      -k <conns>   idle keep-alive connections kept per remote server
+ *                   (default: 8, 0 = close after every response), see
+ *                   upstream.h
+ *      -t <seconds> close idle remote server connections after <seconds>
+ *                   seconds (default: 30)
+ *      -u <conns>   most connections in use per remote server, a request
+ *                   waits up to the connect timeout for one (default: 32,
+ *                   0 = no limit, needs -k > 0), see upstream.h
+ *      -d <seconds> keep resolved remote server addresses for <seconds>
+ *                   seconds (default: 60, 0 = no resolver cache), see dns.h
+ *      -n <msec>    give up connecting to the remote server after <msec>
+ *                   milliseconds (default: 5000), see connect.h
+ *      -e <seconds> keep responses without max-age or Expires fresh for
+ *                   <seconds> seconds (default: 300, 0 = don't cache them)
  * 
  * Erro Handling: Error handling is done by using wrapper functions
  *      modified from csapp.c
  *      - openclientfd_r for thread safety
  *      - Rio_readlineb_r to proper handle the error when errno = EPIPE
+ *      - Rio_readlinev_r to proper handle the error when errno = EPIPE
  *      - Rio_readnb_r to proper handle the error when errno = EPIPE
  *      - Rio_writen_r to proper handle the error when errno = ECONNRESET
  *      Moreover, the exit() functions is removed from the following functions
@@ -36,59 +76,181 @@
  *      - app_error
  *      Finally, SIGPIPE is ignored.
  * 
- * Concurency: Concurency is handled by using thread function.
+ * Concurency: Concurency is handled by using thread function. By default
+ *      one thread is created per connection. In pool mode a fixed number of
+ *      worker threads take the accepted connections from a bounded queue
+ *      (sbuf.c), so a burst of connections can't create unbounded threads.
+ *      The statistics report (-r) shows how long connections waited there.
+ * 
+ * Keep-alive: A client connection serves requests until client closes it
+ *      (HTTP/1.1 or Connection: keep-alive), including pipelined requests,
+ *      see doit(). It is closed after KEEP_ALIVE_TIMEOUT idle seconds or
+ *      after a response whose end client can't tell without the close.
+ *      In pool mode an idle client holds its worker for that long.
+ * 
+ * Buffers: A request takes a buffer for the response it may cache from a
+ *      pool (bufpool.h) only on a cache miss and gives it back after the
+ *      response, so hits, streams, failed requests and idle connections
+ *      use no buffer. A pool worker keeps its buffer for the next request.
  * 
  * Synchronization: Synchronization is handled by using semaphores for cache
  *      access. This proxy uses the reader and writer model and gives the
  *      higher priority to the readers. Many readers may read the cache at the
  *      time but only one writeer can write to the cache.
  */
+#define _GNU_SOURCE /* CPU_SET and pthread_setaffinity_np */
 #include "csapp.h"
+#include <poll.h>
+#include <sys/uio.h>
 #include "cache.h"
+#include "http.h"
+#include "event.h"
+#include "sbuf.h"
+#include "upstream.h"
+#include "dns.h"
+#include "connect.h"
+#include "bufpool.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define DEBUG 0 /* Turn on if you want the server to show the debug messages */
 #define SHOW_CONTENT 0 /* Turn on to show response body in debug mode */
+#define MAX_CACHE_SHARDS 64
+#define KEEP_ALIVE_TIMEOUT 5 /* Seconds to wait for the next client request */
+#define SPLICE_SIZE 65536 /* Bytes moved per splice() */
+#define REQUEST_STORAGE_SIZE 1024 /* Request kept on the stack, see http_buf */
 
-/* You won't lose style points for including these long lines in your code */
-/* Default value for required headers */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+/* Global variables for cache */
+static proxy_cache *my_cache = NULL;
+static int cache_enable = 1; /* Cache is on my default */
+static int cache_shards = 0; /* 0 = one shard per core */
+static int cache_policy = CACHE_LRU;
+static int cache_admission = 0; /* Admit all */
+#define CACHE_DEFAULT_TTL 300
+static int cache_ttl = CACHE_DEFAULT_TTL; /* Without max-age or Expires */
 
-/* Additional header string */
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+/* Statistics report interval in seconds, 0 = no report */
+static int report_interval = 0;
 
-/* Default protocol and port */
-static const char *default_protocol = "http";
-static const char *default_port = "80";
+/* Server mode */
+#define MODE_THREAD 0 /* One thread per connection */
+#define MODE_EVENT 1 /* Event driven, see event.h */
+#define MODE_POOL 2 /* Prethreaded workers */
+static int server_mode = MODE_THREAD;
 
-/* Force using HTTP/1.0 version (set to 1 if want to use HTTP/1.0)*/
-static int use_old_version = 1;
+/* Worker pool */
+#define POOL_WORKERS_PER_CORE 8
+#define POOL_QUEUE_DEPTH 256
+static int pool_workers = 0; /* 0 = POOL_WORKERS_PER_CORE per core */
+static int pool_depth = POOL_QUEUE_DEPTH;
+static int pool_reject = 0; /* 1 = reply 503 when queue is full */
+static sbuf_t pool_queue;
 
-/* Global variables for cache */
-static proxy_cache *my_cache = NULL;
-static int cache_enable = 1; /* Cache is on my default */
+/* SO_REUSEPORT listeners */
+#define MAX_LISTENERS 256
+static int listeners = 0; /* 0 = one normal listener */
+static int listen_fds[MAX_LISTENERS];
+static int pin_cores = 0; /* 1 = pin listener i to core i */
+
+/* Keep-alive connections to the remote servers */
+#define UPSTREAM_MAX_IDLE 8
+#define UPSTREAM_IDLE_TIMEOUT 30
+#define UPSTREAM_MAX_ACTIVE 32
+static int upstream_max_idle = UPSTREAM_MAX_IDLE; /* 0 = no keep-alive */
+static int upstream_timeout = UPSTREAM_IDLE_TIMEOUT;
+static int upstream_max_active = UPSTREAM_MAX_ACTIVE; /* 0 = no limit */
+static upstream_pool *upstream = NULL;
+
+/* Resolver cache */
+#define DNS_TTL 60
+static int dns_ttl = DNS_TTL; /* 0 = no resolver cache */
+static dns_cache *dns = NULL;
+
+/* Connection race to the remote server */
+#define CONNECT_TIMEOUT_MS 5000
+static int connect_timeout = CONNECT_TIMEOUT_MS;
+
+/* Response buffers of the cache misses, see bufpool.h */
+#define CONTENT_POOL_FREE 16 /* Free buffers kept for all threads */
+static buffer_pool *content_pool = NULL;
+
+/* Buffers of one forwarded request, on the heap so the stack of a
+ * connection waiting for its next request stays small */
+typedef struct forward_buf {
+    rio_t rio_server; /* Connect to remote server */
+    char line[MAXLINE]; /* Response line, header or body piece */
+    char client_data[MAXBUF]; /* Status line and headers not sent yet */
+    char request_storage[MAXLINE]; /* Request to the remote server */
+    char header_storage[MAXLINE]; /* Response headers until they are sent */
+    http_buf header; /* Status line and headers kept for the cache */
+    buffer_cache *buffers; /* Where content comes from */
+    char *content; /* Response buffer, NULL unless it can be cached */
+} forward_buf;
+
+/* Reply when the pool queue is full */
+static const char *unavailable_response = 
+"HTTP/1.0 503 Service Unavailable\r\n"
+"Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Reply when the request headers are over REQUEST_HEADER_MAX */
+static const char *header_too_large_response = 
+"HTTP/1.0 431 Request Header Fields Too Large\r\n"
+"Content-Length: 0\r\nConnection: close\r\n\r\n";
 
 /*****************************************************************************
  * Function prototype
  *****************************************************************************/
-static void doit(int connfd);
-static int parse_request(char *req, 
-char *method, char *protocol, char *host, char *uri, char *port, char *ver);
-
-static void construct_request_header(rio_t *rio, 
-char *host, char *port, char *proxy_reqhdr);
+static void doit(int connfd, buffer_cache *buffers);
+static int serve_request(int connfd, rio_t *rio_client, 
+buffer_cache *buffers);
+static forward_buf *new_forward_buf(buffer_cache *buffers);
+static void free_forward_buf(forward_buf *fwd);
+static int forward_request(int connfd, char *method, char *host, char *uri, 
+char *port, char *version, char *client_header, forward_buf *fwd, 
+long *content_len, cache_block *stale_block, http_response *response, 
+int *ttl_ptr, cache_block **fill_ptr, int *keep_alive_ptr);
+static int stream_fill(int connfd, cache_block *fill_block, long *sent, 
+int *keep_alive_ptr);
+static int send_stored(int connfd, char *data, int len, int complete, 
+int *keep_alive_ptr);
+static int send_not_modified(int connfd, cache_block *block_ptr, 
+int *keep_alive_ptr);
+static void save_header(forward_buf *fwd, long *content_len, char *data, 
+int len);
+static void save_content(forward_buf *fwd, long *content_len, char *data, 
+int len, cache_block **fill_ptr);
+static int relay_body(int *connfd_ptr, forward_buf *fwd, 
+http_response *response, long sent, long *content_len, 
+cache_block **fill_ptr);
+static int queue_data(int connfd, char *out, int *out_len, char *data, 
+int len);
+static int relay_length(int *connfd_ptr, forward_buf *fwd, long length, 
+long *content_len, cache_block **fill_ptr);
+static int relay_data(int *connfd_ptr, forward_buf *fwd, char *data, int len, 
+long *content_len, cache_block **fill_ptr);
+static int use_splice(int connfd, forward_buf *fwd, long content_len, 
+long length, cache_block **fill_ptr);
+static int relay_splice(int connfd, forward_buf *fwd, long length, 
+long *content_len);
+static int read_request_line(rio_t *rio, http_buf *request);
+static int read_request_header(rio_t *rio, http_buf *client_header);
 
 static int open_clientfd_r(char *hostname, char *port);
 static void *thread(void *vargp);
+static void *worker(void *vargp);
+static void serve(int listenfd);
+static void *acceptor(void *vargp);
+static int open_listenfd_reuseport(int port);
+static void reject(int connfd);
+static void usage(char *prog);
+static void *report(void *vargp);
 static void *end_of_content(void* content, int length);
 static ssize_t Rio_readnb_r(rio_t *rp, void *usrbuf, size_t n);
 static ssize_t Rio_readlineb_r(rio_t *rp, void *usrbuf, size_t maxlen);
+static ssize_t Rio_readlinev_r(rio_t *rp, char **linep);
 static ssize_t Rio_writen_r(int fd, void *usrbuf, size_t n);
+static ssize_t Rio_writev_r(int fd, struct iovec *iov, int iovcnt);
 /*****************************************************************************
  * End function prototype
  *****************************************************************************/
@@ -99,51 +261,298 @@ static ssize_t Rio_writen_r(int fd, void *usrbuf, size_t n);
  */
 int 
 main(int argc, char **argv) {
-    int listenfd, port, clientlen;
-    int *connfd_ptr;
-    struct sockaddr_in clientaddr;
+    int listenfd, port, opt, i;
+    int *index_ptr;
     pthread_t tid;
     
     /* Ignore SIGPIPE */
     Signal(SIGPIPE, SIG_IGN);
     
+    /* Check options */
+    while ((opt = getopt(argc, argv, 
+    "s:p:a:r:m:w:q:o:l:ck:t:u:d:n:e:")) != -1) {
+        switch (opt) {
+        case 's': /* Number of cache shards */
+            cache_shards = atoi(optarg);
+            if (cache_shards < 1 || cache_shards > MAX_CACHE_SHARDS) {
+                fprintf(stderr, "Invalid number of shards\n");
+                exit(1);
+            }
+            break;
+        case 'p': /* Cache eviction policy */
+            if (!strcmp(optarg, "lru")) {
+                cache_policy = CACHE_LRU;
+            }
+            else if (!strcmp(optarg, "clock")) {
+                cache_policy = CACHE_CLOCK;
+            }
+            else if (!strcmp(optarg, "gdsf")) {
+                cache_policy = CACHE_GDSF;
+            }
+            else {
+                fprintf(stderr, "Invalid cache policy\n");
+                exit(1);
+            }
+            break;
+        case 'a': /* Cache admission policy */
+            if (!strcmp(optarg, "all")) {
+                cache_admission = 0;
+            }
+            else if (!strcmp(optarg, "tinylfu")) {
+                cache_admission = CACHE_ADMIT_TINYLFU;
+            }
+            else {
+                fprintf(stderr, "Invalid admission policy\n");
+                exit(1);
+            }
+            break;
+        case 'r': /* Statistics report interval */
+            if ((report_interval = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid report interval\n");
+                exit(1);
+            }
+            break;
+        case 'm': /* Server mode */
+            if (!strcmp(optarg, "thread")) {
+                server_mode = MODE_THREAD;
+            }
+            else if (!strcmp(optarg, "event")) {
+                server_mode = MODE_EVENT;
+            }
+            else if (!strcmp(optarg, "pool")) {
+                server_mode = MODE_POOL;
+            }
+            else {
+                fprintf(stderr, "Invalid server mode\n");
+                exit(1);
+            }
+            break;
+        case 'w': /* Number of pool workers */
+            if ((pool_workers = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid number of workers\n");
+                exit(1);
+            }
+            break;
+        case 'q': /* Pool queue depth */
+            if ((pool_depth = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid queue depth\n");
+                exit(1);
+            }
+            break;
+        case 'o': /* Pool queue overflow policy */
+            if (!strcmp(optarg, "block")) {
+                pool_reject = 0;
+            }
+            else if (!strcmp(optarg, "reject")) {
+                pool_reject = 1;
+            }
+            else {
+                fprintf(stderr, "Invalid overflow policy\n");
+                exit(1);
+            }
+            break;
+        case 'l': /* Number of SO_REUSEPORT listeners */
+            listeners = atoi(optarg);
+            if (listeners < 1 || listeners > MAX_LISTENERS) {
+                fprintf(stderr, "Invalid number of listeners\n");
+                exit(1);
+            }
+            break;
+        case 'c': /* Pin listeners to cores */
+            pin_cores = 1;
+            break;
+        case 'k': /* Idle connections per remote server */
+            if ((upstream_max_idle = atoi(optarg)) < 0) {
+                fprintf(stderr, "Invalid number of idle connections\n");
+                exit(1);
+            }
+            break;
+        case 't': /* Idle connection timeout */
+            if ((upstream_timeout = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid idle timeout\n");
+                exit(1);
+            }
+            break;
+        case 'u': /* Active connections per remote server */
+            if ((upstream_max_active = atoi(optarg)) < 0) {
+                fprintf(stderr, "Invalid number of active connections\n");
+                exit(1);
+            }
+            break;
+        case 'd': /* Resolver cache TTL */
+            if ((dns_ttl = atoi(optarg)) < 0) {
+                fprintf(stderr, "Invalid DNS TTL\n");
+                exit(1);
+            }
+            break;
+        case 'n': /* Connect timeout */
+            if ((connect_timeout = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid connect timeout\n");
+                exit(1);
+            }
+            break;
+        case 'e': /* Default freshness */
+            if ((cache_ttl = atoi(optarg)) < 0) {
+                fprintf(stderr, "Invalid cache TTL\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    
     /* Check command line args */
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "usage: %s <port> <cahche_status>\n", argv[0]);
-        exit(1);
+    if (argc - optind < 1 || argc - optind > 2) {
+        usage(argv[0]);
     }
     
     /* Check port */
-    if ((port = atoi(argv[1])) == 0){
+    if ((port = atoi(argv[optind])) == 0){
         fprintf(stderr, "Invalid port number\n");
         exit(1);
     }
     
     /* Prepare cahce */
-    if (argc == 3){
+    if (argc - optind == 2){
         /* When receive "disable, don't use cache" */
-        if (!strcmp(argv[2], "disable")) {
+        if (!strcmp(argv[optind + 1], "disable")) {
             cache_enable = 0;
         }
     } else { /* If not specified or else, always use cache */
         cache_enable = 1;
     }
     
+    /* Default to one shard per core */
+    if (cache_shards == 0) {
+        cache_shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    
     /* Initialize cahce */
     if (cache_enable) {
-        my_cache = init_cache(MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+        my_cache = init_cache(MAX_CACHE_SIZE, MAX_OBJECT_SIZE, cache_shards, 
+        cache_policy | cache_admission, cache_ttl);
         if (my_cache == NULL) {
             fprintf(stderr, "Can't initialize cache, please try again\n");
             exit(1);
         }
+        
+        content_pool = init_buffer_pool(MAX_OBJECT_SIZE, CONTENT_POOL_FREE);
+        if (content_pool == NULL) {
+            fprintf(stderr, "Can't initialize buffer pool\n");
+            exit(1);
+        }
+    }
+    
+    /* Keep the connections to the remote servers (thread and pool mode) */
+    if (upstream_max_idle > 0 && server_mode != MODE_EVENT) {
+        upstream = init_upstream_pool(upstream_max_idle, upstream_timeout, 
+        upstream_max_active);
+        if (upstream == NULL) {
+            fprintf(stderr, "Can't initialize upstream pool\n");
+            exit(1);
+        }
+    }
+    
+    /* Resolver cache */
+    if (dns_ttl > 0 && (dns = init_dns_cache(dns_ttl)) == NULL) {
+        fprintf(stderr, "Can't initialize resolver cache\n");
+        exit(1);
+    }
+    
+    /* Prethread the workers */
+    if (server_mode == MODE_POOL) {
+        if (pool_workers == 0) {
+            pool_workers = POOL_WORKERS_PER_CORE * 
+            (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        
+        sbuf_init(&pool_queue, pool_depth);
+        for (i = 0; i < pool_workers; i++) {
+            Pthread_create(&tid, NULL, worker, NULL);
+        }
+    }
+    
+    /* Start reporting thread if desired */
+    if (report_interval > 0 && 
+    (cache_enable || server_mode == MODE_POOL || upstream != NULL || 
+    dns != NULL)) {
+        Pthread_create(&tid, NULL, report, NULL);
+    }
+    
+    /* One listener for the whole proxy */
+    if (listeners == 0) {
+        /* Get socket descriptor */
+        if ((listenfd = Open_listenfd(port)) < 0) {
+            fprintf(stderr, "Listen error\n");
+            exit(1);
+        }
+        
+        serve(listenfd);
+    }
+    
+    /* One SO_REUSEPORT listener per acceptor, the kernel spreads the
+     * connections between them */
+    for (i = 0; i < listeners; i++) {
+        if ((listen_fds[i] = open_listenfd_reuseport(port)) < 0) {
+            fprintf(stderr, "Listen error\n");
+            exit(1);
+        }
+    }
+    
+    for (i = 1; i < listeners; i++) {
+        if ((index_ptr = (int *)Malloc(sizeof(int))) != NULL) {
+            *index_ptr = i;
+            Pthread_create(&tid, NULL, acceptor, (void *)index_ptr);
+        }
     }
     
-    /* Get socket descriptor */
-    if ((listenfd = Open_listenfd(port)) < 0) {
-        fprintf(stderr, "Listen error\n");
+    /* Main thread is the first acceptor */
+    index_ptr = (int *)Malloc(sizeof(int));
+    *index_ptr = 0;
+    acceptor((void *)index_ptr);
+    
+    return 0;
+}
+
+/*
+ * serve: Accept the connections from listenfd and serve them with the
+ *      server mode, never returns.
+ */
+void 
+serve(int listenfd) {
+    int connfd, clientlen;
+    int *connfd_ptr;
+    struct sockaddr_in clientaddr;
+    pthread_t tid;
+    
+    /* Serve every connection from one thread */
+    if (server_mode == MODE_EVENT) {
+        run_event_loop(listenfd, my_cache, dns, connect_timeout);
+        fprintf(stderr, "Event loop error\n");
         exit(1);
     }
     
+    /* Hand the connections to the workers */
+    if (server_mode == MODE_POOL) {
+        while (1) {
+            clientlen = sizeof(clientaddr);
+            connfd = Accept(listenfd, (SA *)&clientaddr, 
+            (socklen_t *)&clientlen);
+            
+            if (connfd < 0) {
+                continue;
+            }
+            
+            if (!pool_reject) {
+                sbuf_insert(&pool_queue, connfd);
+            }
+            else if (sbuf_tryinsert(&pool_queue, connfd) < 0) {
+                reject(connfd);
+            }
+        }
+    }
+    
     while (1) {
         clientlen = sizeof(clientaddr);
         connfd_ptr = (int*)Malloc(sizeof(int));
@@ -156,10 +565,79 @@ main(int argc, char **argv) {
     }
 }
 
+/*
+ * acceptor: Serve the connections of one SO_REUSEPORT listener. If pinning
+ *      is on, the acceptor runs on core (index % number of cores), the
+ *      threads it creates inherit the core.
+ */
+void 
+*acceptor(void *vargp) {
+    int index;
+    cpu_set_t cpu_set;
+    
+    index = *((int *)vargp);
+    Free(vargp);
+    
+    if (pin_cores) {
+        CPU_ZERO(&cpu_set);
+        CPU_SET(index % (int)sysconf(_SC_NPROCESSORS_ONLN), &cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), 
+        &cpu_set) != 0) {
+            fprintf(stderr, "Can't pin listener %d\n", index);
+        }
+    }
+    
+    serve(listen_fds[index]);
+    return NULL;
+}
+
 /*****************************************************************************
  * Helper functions
  *****************************************************************************/
 
+/*
+ * usage: Print command line usage and exit
+ */
+void 
+usage(char *prog) {
+    fprintf(stderr, "usage: %s [-s <shards>] [-p lru|clock|gdsf] "
+    "[-a all|tinylfu] [-r <seconds>] [-m thread|pool|event] "
+    "[-w <workers>] [-q <depth>] [-o block|reject] [-l <listeners>] [-c] "
+    "[-k <conns>] [-t <seconds>] [-u <conns>] [-d <seconds>] [-n <msec>] "
+    "[-e <seconds>] <port> <cahche_status>\n", prog);
+    exit(1);
+}
+
+/*
+ * report: Print cache, queue, upstream and resolver statistics
+ *      periodically.
+ */
+void 
+*report(void *vargp) {
+    Pthread_detach(pthread_self());
+    
+    while (1) {
+        Sleep(report_interval);
+        if (cache_enable) {
+            print_cache_stats(my_cache, stdout);
+        }
+        if (server_mode == MODE_POOL) {
+            print_sbuf_stats(&pool_queue, stdout);
+        }
+        if (upstream != NULL) {
+            print_upstream_stats(upstream, stdout);
+        }
+        if (dns != NULL) {
+            print_dns_stats(dns, stdout);
+        }
+        if (content_pool != NULL) {
+            print_buffer_pool_stats(content_pool, stdout);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
 /*
  * thread: Perform concurent request handling.
  */
@@ -167,6 +645,7 @@ void
 *thread(void *vargp) {
     Pthread_detach(pthread_self());
     int connfd;
+    buffer_cache buffers;
     
     if (vargp == NULL) {
         fprintf(stderr, "Connfd error\n");
@@ -175,7 +654,10 @@ void
     
     connfd = *((int *)vargp);
     Free(vargp);
-    doit(connfd);
+    
+    /* The thread lives for one connection, it keeps no free buffer */
+    init_buffer_cache(&buffers, content_pool, 0);
+    doit(connfd, &buffers);
     
     /* Safely close connection */
     if (connfd >= 0 ) {
@@ -185,479 +667,1129 @@ void
 }
 
 /*
- * doit: Handle the request from client. will handle only GET request.
- *      The process is as follow:
+ * worker: Pool worker, serve the connections from the queue forever
+ */
+void 
+*worker(void *vargp) {
+    int connfd;
+    buffer_cache buffers; /* Reused for every connection of the worker */
+    
+    Pthread_detach(pthread_self());
+    init_buffer_cache(&buffers, content_pool, BUFFER_CACHE_SIZE);
+    
+    while (1) {
+        connfd = sbuf_remove(&pool_queue);
+        doit(connfd, &buffers);
+        
+        /* Safely close connection */
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * reject: Tell the client the proxy is too busy and close the connection
+ */
+void 
+reject(int connfd) {
+    Rio_writen_r(connfd, (void *)unavailable_response, 
+    strlen(unavailable_response));
+    Close(connfd);
+}
+
+/*
+ * doit: Serve the requests from client on its connection in order. Client
+ *      may send the next requests before it gets our response (pipelining),
+ *      they wait in rio_client. The connection ends after a response that
+ *      can't keep it or when client sends nothing for KEEP_ALIVE_TIMEOUT
+ *      seconds. The response buffers are taken from buffers.
+ */
+void 
+doit(int connfd, buffer_cache *buffers) {
+    rio_t rio_client; /* Connect to our client */
+    struct pollfd poll_fd;
+    
+    Rio_readinitb(&rio_client, connfd);
+    
+    while (serve_request(connfd, &rio_client, buffers)) {
+        /* Wait for the next request unless we have it already */
+        if (rio_client.rio_cnt == 0) {
+            poll_fd.fd = connfd;
+            poll_fd.events = POLLIN;
+            if (poll(&poll_fd, 1, KEEP_ALIVE_TIMEOUT * 1000) <= 0) {
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * serve_request: Handle one request from client. will handle only GET
+ *      request. The process is as follow:
  *      - Read client request
  *      - search cache if enable
- *      - if cache hit, return the content to client
+ *      - if cache hit, return the content to client (or 304 Not Modified
+ *          if client has the same copy)
+ *      - if the cached copy is stale, ask the server with its validators
+ *          and serve it as a hit if the server answers 304
+ *      - if another request is fetching the same object, stream the response
+ *          to client as that request receives it (collapsed forwarding)
  *      - if cache miss, forward client request to server then receive the 
  *          response from server and send back to client.
  *      - if the response from server is not too big, write data to cache.
+ *      The request is read into a small buffer that grows on the heap only
+ *      for a large one. Only a cache miss allocates the buffers to forward
+ *      the request, and only a response that can be cached takes a response
+ *      buffer from buffers, they are all given back before we return.
+ * 
+ * return 1 = client may send the next request, 0 = close the connection
  */
-void 
-doit(int connfd) {
+int 
+serve_request(int connfd, rio_t *rio_client, buffer_cache *buffers) {
     /* Request from client */
-    char client_request[MAXLINE];
+    char request_storage[REQUEST_STORAGE_SIZE];
+    http_buf request; /* Request line then headers, grows on the heap */
+    char *client_header;
+    int line_len, keep_alive;
     
     /* Parameter obtain by parsing client request */
-    char method[MAXLINE];
-    char protocol[MAXLINE]; /* for future use */
-    char host[MAXLINE];
-    char uri[MAXLINE];
-    char port[MAXLINE];
-    char version[MAXLINE];
-    
-    /* IO */
-    int proxyfd; /* Connect to remote server */
-    rio_t rio_server; /* Connect to remote server */
-    rio_t rio_client; /* Connect to our client */
-    
-    /* For building request the remote server */
-    char proxy_reqln[MAXLINE];
-    char proxy_reqhdr[MAXLINE];
-    
-    /* For sending response to our client */
-    char server_response[MAXLINE];
-    unsigned int read_len = 0;
+    char method[METHOD_SIZE];
+    char protocol[PROTOCOL_SIZE]; /* for future use */
+    char host[HOST_SIZE];
+    char *uri = NULL; /* Room for the request line, on the heap */
+    char port[PORT_SIZE];
+    char version[VERSION_SIZE];
     
     /* For cache */
-    char cache_content[MAX_OBJECT_SIZE];
-    int cache_read_len = -1;
-    int cache_write_len = 0;
+    forward_buf *fwd = NULL; /* Buffers to forward the request on a miss */
+    cache_block *cached_block = NULL; /* Pinned block if cache hit */
+    cache_block *fill_block = NULL; /* Placeholder if we fill the cache */
+    cache_block *stale_block = NULL; /* Pinned stale block to revalidate */
+    int cache_status = CACHE_MISS;
+    long cache_write_len = 0;
+    int fresh_ttl = 0; /* Freshness of the response, 0 = don't cache it */
+    http_response response; /* Response from server on a miss */
+    int rc;
     
-    /* Initailize cache content */
-    memset((void *)cache_content, 0, MAX_OBJECT_SIZE);
-    
-    /* Read client request line */
-    Rio_readinitb(&rio_client, connfd);
-    
-    /* Read request from client, return if error */
-    if (Rio_readlineb_r(&rio_client, client_request, MAXLINE) < 0) {
-        return;
+    /* Read request from client, return if error or client is done */
+    init_http_buf(&request, request_storage, sizeof(request_storage));
+    if ((line_len = read_request_line(rio_client, &request)) <= 0 || 
+    (uri = (char *)Malloc(line_len + 2)) == NULL) {
+        free_http_buf(&request);
+        return 0;
     }
     
-    /* Parse client_request and get parameters*/
-    if (parse_request(client_request, 
+    /* Parse client request and get parameters*/
+    if (parse_request(request.data, 
     method, protocol, host, uri, port, version) == -1) {
         /* Return if parsing fail */
-        return;
+        free_http_buf(&request);
+        Free(uri);
+        return 0;
+    }
+    
+    /* Read the headers after the line, they tell if client keeps the
+     * connection */
+    if (read_request_header(rio_client, &request) < 0) {
+        if (!request.error) {
+            Rio_writen_r(connfd, (void *)header_too_large_response, 
+            strlen(header_too_large_response));
+        }
+        free_http_buf(&request);
+        Free(uri);
+        return 0;
     }
+    client_header = request.data + line_len;
+    keep_alive = request_keep_alive(request.data, client_header);
     
     /* Ignore non GET request */
     if (strcasecmp(method, "GET")) {
-        /* Not reponsible for other method. Kill thread! */ 
-        if (connfd >= 0) {
-            Close(connfd);
-        }
-        Pthread_exit(NULL);
+        /* Not reponsible for other method, the caller closes connfd */ 
+        free_http_buf(&request);
+        Free(uri);
+        return 0;
     }                                                    
     
     /* Search cache if cache is enable */
     if (cache_enable) {
-        cache_read_len = read_cache(my_cache, host, uri, cache_content);
+        cache_status = lookup_cache(my_cache, host, uri, &cached_block);
+        if (cache_status == CACHE_FILL) {
+            fill_block = cached_block;
+            cached_block = NULL;
+        }
+        else if (cache_status == CACHE_REVALIDATE) {
+            stale_block = cached_block;
+            cached_block = NULL;
+        }
     }
     
-    /* Request process */
-    if (cache_read_len < 0) { /* Cache miss or unused, forward request */
-        
+    /* The object is on its way, stream it as it arrives. Fetch it by 
+     * ourselves only if the fill was aborted before anything was sent */
+    if (cache_status == CACHE_STREAM) {
         if (DEBUG) {
-            fprintf(stdout, "Cache MISS: host: %s, uri: %s\n", host, uri);
-            fprintf(stdout, "*****Process request regularly*****\n\n");
+            fprintf(stdout, "Cache STREAM: host: %s, uri: %s\n", host, uri);
         }
-        /* Forward client request to server */
-        /* Construct request lines */
-        sprintf(proxy_reqln, "%s %s %s\r\n", method, uri, version);
         
-        /* Construct header lines */
-        construct_request_header(&rio_client, host, port, proxy_reqhdr);
-        
-        /* Get channel fd to contact with remote server*/
-        proxyfd = open_clientfd_r(host, port);
-        
-        if (proxyfd < 0) { /* Can't connect to server */
-            return;
-        }
-        
-        /* Forward request line to remote server */
-        if (Rio_writen_r(proxyfd, proxy_reqln, strlen(proxy_reqln)) < 0) {
-            /* Close connection with remote server and return if error */
-            if (proxyfd >= 0) {
-                Close(proxyfd);
-            }
-            return;
-        }
-        
-        if (DEBUG) { // Display request line
-            fprintf(stdout, "%s", proxy_reqln);
-        }
-        
-        /* Forward header lines to the remote server */
-        if (Rio_writen_r(proxyfd, proxy_reqhdr, strlen(proxy_reqhdr)) < 0) {
-            /* Close connection with remote server and return if error */
-            if (proxyfd >= 0) {
-                Close(proxyfd);
-            }
-            return;
+        if (stream_fill(connfd, cached_block, &cache_write_len, 
+        &keep_alive) == 0 || cache_write_len > 0) {
+            free_http_buf(&request);
+            Free(uri);
+            return keep_alive;
         }
+        cached_block = NULL;
+        cache_write_len = 0;
+    }
+    
+    /* Request process */
+    if (cached_block == NULL) { /* Cache miss or unused, forward request */
         
-        if (DEBUG) { // Display Headers
-            fprintf(stdout, "%s", proxy_reqhdr);
+        if (DEBUG) {
+            fprintf(stdout, "Cache MISS: host: %s, uri: %s\n", host, uri);
+            fprintf(stdout, "*****Process request regularly*****\n\n");
         }
         
-        /* Get response from remote server */
-        /* IO init */
-        Rio_readinitb(&rio_server, proxyfd);
-        
-        /* Read response line from server*/
-        if ((read_len = Rio_readlineb_r(&rio_server, 
-        server_response, MAXLINE)) < 0) {
-            /* Close connection with remote server and return */
-            if (proxyfd >= 0) {
-                Close(proxyfd);
-            }
-            return;
+        /* Hold a connection slot of the server, see upstream.h. The
+         * response buffer is taken once the headers say it can be cached */
+        if ((fwd = new_forward_buf(buffers)) == NULL || 
+        upstream_acquire(upstream, host, port, connect_timeout) < 0) {
+            rc = -1;
         }
-        
-        if (DEBUG) { // Display server response line
-            fprintf(stdout, "**********Server Response**********\n\n");
-            fprintf(stdout, "%s", server_response);
+        else {
+            rc = forward_request(connfd, method, host, uri, port, version, 
+            client_header, fwd, &cache_write_len, stale_block, 
+            &response, &fresh_ttl, &fill_block, &keep_alive);
+            upstream_release(upstream, host, port);
         }
-        
-        /* Put data in cache if available */
-        if (cache_enable) {
-            if (cache_write_len + read_len <= MAX_OBJECT_SIZE) {
-                /* Accumulate length and content */
-                memcpy(end_of_content(cache_content, cache_write_len), 
-                (void *)server_response, read_len);
+        if (rc < 0) {
+            /* Tell the readers the response is incomplete */
+            if (fill_block != NULL) {
+                abort_fill(my_cache, fill_block);
             }
-            /* Keep track of total response size */
-            cache_write_len += read_len;
+            unpin_cache(my_cache, stale_block);
+            free_forward_buf(fwd);
+            free_http_buf(&request);
+            Free(uri);
+            return 0;
         }
         
-        /* Send response line to client */
-        if (Rio_writen_r(connfd, server_response, read_len) < 0) {
-            /* Close connection with remote server and return if error */
-            if (proxyfd >= 0) {
-                Close(proxyfd);
+        /* Server says our stale copy is still good, serve it as a hit */
+        if (rc == 1) {
+            if (DEBUG) {
+                fprintf(stdout, "Cache REVALIDATED\n");
             }
-            return;
+            
+            refresh_cache(my_cache, stale_block, revalidated_ttl( 
+            stale_block->payload, stale_block->payload_size, &response, 
+            my_cache->default_ttl));
+            cached_block = stale_block;
+            stale_block = NULL;
         }
         
-        /* Response headers processing*/
-        while(1) {
+        /* Write to cache if possible, our placeholder holds the response
+         * already and the readers finish from it even if it's too big */
+        else if (cache_enable) {
+            count_miss_bytes(my_cache, host, uri, cache_write_len);
             
-            /* Keep reading header from server */
-            if ((read_len = Rio_readlineb_r(&rio_server, 
-            server_response, MAXLINE)) < 0) {
-                
-                /* Close connection with remote server and return if error */
-                if (proxyfd >= 0) {
-                    Close(proxyfd);
+            if (fill_block != NULL) {
+                if (DEBUG) { // Display cache process
+                    fprintf(stdout, "Fill cache, Length: %ld\n", 
+                    cache_write_len);
                 }
-                return;
+                fill_cache(my_cache, fill_block, fresh_ttl, response.etag, 
+                response.last_modified);
             }
-            
-            if (DEBUG) { // Display response headers
-                fprintf(stdout, "%s", server_response);
-            }
-            
-            /* Put data in cache if available */
-            if (cache_enable) {
+            else if (cache_status != CACHE_FILL && fwd->content != NULL && 
+            cache_write_len <= MAX_OBJECT_SIZE) { /* Not aborted fill */
+                
+                if (DEBUG) { // Display cache process
+                    fprintf(stdout, "Try to write to cache\n");
+                    fprintf(stdout, "Content Length: %ld\n", 
+                    cache_write_len);
+                }
                 
-                if (cache_write_len + read_len <= MAX_OBJECT_SIZE) {
-                    /* Accumulate length and content */
-                    memcpy(end_of_content(cache_content, cache_write_len), 
-                    (void *)server_response, read_len);
+                if (write_cache(my_cache, host, uri, (void*) fwd->content, 
+                cache_write_len, fresh_ttl, response.etag, 
+                response.last_modified) < 0) {
+                    if (DEBUG) {
+                        fprintf(stdout, "Write Fail\n");
+                    }
                 }
-                cache_write_len += read_len;
-            }
-            
-            /* Forward to client */
-            if (Rio_writen_r(connfd, server_response, read_len) < 0) {
-                /* Close connection with remote server and return if error */
-                if (proxyfd >= 0) {
-                    Close(proxyfd);
+                else {
+                    if (DEBUG) {
+                        fprintf(stdout, "Write Success\n");
+                    }
                 }
-                return;
-            }
-            
-            /* Stop after sending all headers to client (include \r\n line) */
-            if(strcmp(server_response,"\r\n") == 0) {
-                break;
             }
         }
-        
-        /* Response body processing*/
-        while((read_len = Rio_readnb_r(&rio_server, 
-        server_response, MAXLINE)) > 0){
-            
-            if (DEBUG) { // display response body
-                if (SHOW_CONTENT) {
-                    fprintf(stdout, "%s", server_response);
-                }
-            }
-            
-            /* Put data in cache if available */
-            if (cache_enable) {
-                if (cache_write_len + read_len <= MAX_OBJECT_SIZE) {
-                    /* Accumulate length and content */
-                    memcpy(end_of_content(cache_content, cache_write_len), 
-                    (void *)server_response, read_len);
-                }
-                cache_write_len += read_len;
-            }
-            
-            if (Rio_writen_r(connfd, server_response, read_len) < 0) {
-                /* Close connection with remote server and return if error */
-                if (proxyfd >= 0) {
-                    Close(proxyfd);
-                }
-                return;
+        unpin_cache(my_cache, stale_block);
+        free_forward_buf(fwd);
+    }
+    
+    if (cached_block != NULL) { /* Cache Hit, reply to client */
+        if (DEBUG) { //Desplay cache content
+            fprintf(stdout, "Cache HIT!\n");
+            if (SHOW_CONTENT) {
+                fprintf(stdout, "Payload:\n%.*s\nLength: %d\n", 
+                cached_block->payload_size, (char *)cached_block->payload, 
+                cached_block->payload_size);
             }
         }
         
-        /* Write to cache if possible*/
-        if (cache_enable) {
-            if (cache_write_len <= MAX_OBJECT_SIZE) {
-                
-                if (DEBUG) { // Display cache process
-                    fprintf(stdout, "Try to write to cache\n");
-                    fprintf(stdout, "Content Length: %d\n", cache_write_len);
-                }
-                
-                if (write_cache(my_cache, host, uri, (void*) cache_content, 
-                cache_write_len) < 0) {
-                    if (DEBUG) {
-                        fprintf(stdout, "Write Fail\n");
-                    }
-                }
-                else {
-                    if (DEBUG) {
-                        fprintf(stdout, "Write Success\n");
-                    }
-                }
-            }
+        /* Client has this copy already, or send cache content back to
+         * user straight from the pinned block */
+        if (request_not_modified(client_header, cached_block->etag, 
+        cached_block->last_modified)) {
+            rc = send_not_modified(connfd, cached_block, &keep_alive);
         }
-        
-        /* Success, safely close the connection with remote server */
-        if (proxyfd >= 0 ) {
-            Close(proxyfd);
+        else {
+            rc = send_stored(connfd, cached_block->payload, 
+            cached_block->payload_size, 1, &keep_alive);
+        }
+        if (rc < 0) {
+            keep_alive = 0;
         }
+        unpin_cache(my_cache, cached_block);
     }
-    else { /* Cache Hit, reply to client */
-        if (DEBUG) { //Desplay cache content
-            fprintf(stdout, "Cache HIT!\n");
-            if (SHOW_CONTENT) {
-                fprintf(stdout, "Payload:\n%s\nLength: %d\n", 
-                cache_content, cache_read_len);
-            }
+    
+    free_http_buf(&request);
+    Free(uri);
+    return keep_alive;
+}
+
+/*
+ * stream_fill: Send the response of a placeholder to client while another
+ *      request is fetching it, then unpin the placeholder. *sent keeps the
+ *      number of bytes sent. *keep_alive_ptr is cleared if the connection
+ *      can't be kept after the response.
+ * 
+ * return 0 = done (or client is gone), -1 = fill aborted
+ */
+int 
+stream_fill(int connfd, cache_block *fill_block, long *sent, 
+int *keep_alive_ptr) {
+    char buffer[MAXBUF];
+    int read_len, rc;
+    
+    while ((read_len = read_fill(my_cache, fill_block, *sent, 
+    buffer, MAXBUF)) > 0) {
+        /* The headers are published at once, they start the first piece */
+        if (*sent == 0) {
+            rc = send_stored(connfd, buffer, read_len, 0, keep_alive_ptr);
+        }
+        else {
+            rc = Rio_writen_r(connfd, buffer, read_len);
         }
         
-        /* Send cache content back to user */
-        if (Rio_writen_r(connfd, cache_content, cache_read_len) < 0) {
-            return;
+        if (rc < 0) {
+            *keep_alive_ptr = 0;
+            read_len = 0;
+            break;
         }
+        *sent += read_len;
     }
+    
+    unpin_cache(my_cache, fill_block);
+    
+    /* Incomplete response */
+    if (read_len < 0) {
+        *keep_alive_ptr = 0;
+    }
+    
+    return (read_len < 0) ? -1 : 0;
 }
 
 /*
- * parse_request: parse the request from client from METHOD URL VERSION 
- *      into small components used to construct the request line.
+ * send_stored: Send the start of a stored response (cached object) to
+ *      client with the Connection header for this client, see
+ *      end_client_header(). If complete is set, data holds the whole
+ *      response so the body length is known. If the headers don't end in
+ *      data, it is sent as it is and *keep_alive_ptr is cleared.
  * 
- * return 1 = success, -1 = error
+ * return 0 = success, -1 = error
  */
 int 
-parse_request(char *req, char *method, 
-char *protocol, char *host, char *uri, char *port, char *ver) {
-    char url[MAXLINE];
-    char host_port_uri[MAXLINE];
-    char host_port[MAXLINE];
-    
-    /* Invalid request length */
-    if (strlen(req) < 1) {
-        return -1;
+send_stored(int connfd, char *data, int len, int complete, 
+int *keep_alive_ptr) {
+    char client_header[CLIENT_HEADER_SIZE];
+    http_response response;
+    struct iovec iov[3];
+    int header_len, empty_len;
+    
+    if ((header_len = parse_response_headers(data, len, &response)) < 0) {
+        *keep_alive_ptr = 0;
+        return (Rio_writen_r(connfd, data, len) < 0) ? -1 : 0;
     }
     
-    /* Decompose into 3 parts */
-    sscanf(req, "%s %s %s", method, url, ver);
+    *keep_alive_ptr = end_client_header(client_header, &response, 
+    complete ? len - header_len : -1, *keep_alive_ptr);
+    
+    /* Headers without the empty line, our lines, then the body, in one
+     * system call */
+    empty_len = (data[header_len - 2] == '\r') ? 2 : 1;
+    iov[0].iov_base = data;
+    iov[0].iov_len = header_len - empty_len;
+    iov[1].iov_base = client_header;
+    iov[1].iov_len = strlen(client_header);
+    iov[2].iov_base = data + header_len;
+    iov[2].iov_len = len - header_len;
+    
+    return (Rio_writev_r(connfd, iov, 3) < 0) ? -1 : 0;
+}
+
+/*
+ * send_not_modified: Tell client that its copy of the cached block is still
+ *      good, a 304 Not Modified (no body) with the validators of the block
+ *      and the Connection header for this client
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+send_not_modified(int connfd, cache_block *block_ptr, int *keep_alive_ptr) {
+    char status_line[] = "HTTP/1.0 304 Not Modified\r\n";
+    char client_header[CLIENT_HEADER_SIZE];
+    char buf[MAXLINE];
+    http_response response;
+    int len;
+    
+    parse_status_line(status_line, &response);
+    end_response_header(&response);
+    *keep_alive_ptr = end_client_header(client_header, &response, -1, 
+    *keep_alive_ptr);
+    
+    len = sprintf(buf, "%s", status_line);
+    if (block_ptr->etag != NULL) {
+        len += sprintf(buf + len, "ETag: %s\r\n", block_ptr->etag);
+    }
+    if (block_ptr->last_modified != NULL) {
+        len += sprintf(buf + len, "Last-Modified: %s\r\n", 
+        block_ptr->last_modified);
+    }
+    len += sprintf(buf + len, "%s", client_header);
+    
+    return (Rio_writen_r(connfd, buf, len) < 0) ? -1 : 0;
+}
+
+/*
+ * forward_request: Forward client request to the remote server then receive
+ *      the response from server and send back to client, in the buffers of
+ *      fwd. *content_len keeps track of the total response size. The status
+ *      and headers are read into *response and *ttl_ptr is set to its
+ *      freshness once from them (0 = don't cache it). Only if they say it
+ *      can be cached, a response buffer is taken for fwd->content and the
+ *      response is accumulated there, the placeholder is aborted otherwise.
+ *      If stale_block is not NULL, the request is conditional on its
+ *      validators. A 304 answer is not sent to client, we return 1 and the
+ *      stale block is served instead.
+ *      If we fill a placeholder (*fill_ptr is not NULL), the headers are
+ *      published once they are all received and the body as it arrives.
+ *      The placeholder is aborted before that if Content-Length says the
+ *      object is too big, so the readers fetch it by themselves instead of
+ *      waiting. Since the readers depend on the transfer, it goes on even
+ *      if our own client is gone.
+ *      With the upstream pool, the request is sent as HTTP/1.1 on an idle
+ *      connection to the server if there is one. The body is read by its
+ *      framing (chunked bodies are decoded) so the connection goes back to
+ *      the pool after a complete response. The Connection header sent to
+ *      client is not stored, and client connection is kept only if the
+ *      body has a length (*keep_alive_ptr is cleared otherwise).
+ *      The request goes to server in one write, the status line,
+ *      headers and the body read with them go to client in one too.
+ * 
+ * return 0 = success, 1 = stale_block is not modified, -1 = error
+ */
+int 
+forward_request(int connfd, char *method, char *host, char *uri, 
+char *port, char *version, char *client_header, forward_buf *fwd, 
+long *content_len, cache_block *stale_block, http_response *response, 
+int *ttl_ptr, cache_block **fill_ptr, int *keep_alive_ptr) {
+    /* IO */
+    int proxyfd; /* Connect to remote server */
+    rio_t *rio_server = &fwd->rio_server; /* Connect to remote server */
+    int reused; /* 1 = proxyfd is from the upstream pool */
+    int server_keep_alive = (upstream != NULL);
+    
+    /* For building request the remote server */
+    http_buf request;
+    
+    /* For sending response to our client */
+    char *server_response = fwd->line;
+    char end_header[CLIENT_HEADER_SIZE];
+    char *client_data = fwd->client_data; /* Not sent yet */
+    int client_len = 0;
+    struct iovec iov[3];
+    ssize_t read_len = 0;
+    int header_end = 0;
+    int cacheable; /* 1 = the headers let us cache the response */
+    
+    /* Forward client request to server */
+    /* Construct request lines */
+    init_http_buf(&request, fwd->request_storage, 
+    sizeof(fwd->request_storage));
+    http_buf_puts(&request, method);
+    http_buf_puts(&request, " ");
+    http_buf_puts(&request, uri);
+    http_buf_puts(&request, server_keep_alive ? " HTTP/1.1\r\n" : " ");
+    if (!server_keep_alive) {
+        http_buf_puts(&request, version);
+        http_buf_puts(&request, "\r\n");
+    }
     
-    /* Version check */
-    if (strstr(ver, "/") == NULL) {
+    /* Construct header lines, give up if there is no memory for them */
+    if (build_request_header(client_header, host, port, &request, 
+    server_keep_alive, stale_block ? stale_block->etag : NULL, 
+    stale_block ? stale_block->last_modified : NULL) < 0) {
+        free_http_buf(&request);
         return -1;
     }
     
-    /* Decompose url to get protocol, host, uri, port */
-    /* Look for protocol */
-    if (strstr(url, "://") == NULL) {
-        sscanf(url, "%s", host_port_uri);
+    /* Get channel fd to contact with remote server, an idle one first. The
+     * server may close an idle connection at any time, so the request is
+     * sent again on a new connection if no response comes on it */
+    proxyfd = upstream_checkout(upstream, host, port);
+    while (1) {
+        reused = (proxyfd >= 0);
+        if (!reused && (proxyfd = open_clientfd_r(host, port)) < 0) {
+            free_http_buf(&request);
+            return -1; /* Can't connect to server */
+        }
+        
+        /* Forward request line and header lines to remote server, then
+         * read response line from server */
+        if (Rio_writen_r(proxyfd, request.data, request.len) == 
+        (ssize_t)request.len) {
+            Rio_readinitb(rio_server, proxyfd);
+            if ((read_len = Rio_readlineb_r(rio_server, 
+            server_response, MAXLINE)) > 0) {
+                break;
+            }
+        }
         
-        /* Apply default protocol */
-        strcpy(protocol, default_protocol);
+        /* Close connection with remote server and return if error */
+        Close(proxyfd);
+        if (!reused) {
+            free_http_buf(&request);
+            return -1;
+        }
+        proxyfd = -1;
     }
-    else {
-        sscanf(url, "%[^:]://%s", protocol, host_port_uri);
+    
+    if (DEBUG) { // Display request and server response line
+        fprintf(stdout, "%s", request.data);
+        fprintf(stdout, "**********Server Response**********\n\n");
+        fprintf(stdout, "%s", server_response);
+    }
+    free_http_buf(&request);
+    
+    /* A broken status line is relayed as is, until server closes */
+    parse_status_line(server_response, response);
+    
+    /* Keep it for the cache, readers get it with the headers */
+    save_header(fwd, content_len, server_response, read_len);
+    
+    /* Response line goes to client with the headers */
+    queue_data(connfd, client_data, &client_len, server_response, read_len);
+    
+    /* Response headers processing*/
+    while(1) {
+        
+        /* Keep reading header from server */
+        if ((read_len = Rio_readlineb_r(rio_server, 
+        server_response, MAXLINE)) <= 0) {
+            
+            /* Close connection with remote server and return if error */
+            Close(proxyfd);
+            return -1;
+        }
+        
+        if (DEBUG) { // Display response headers
+            fprintf(stdout, "%s", server_response);
+        }
+        
+        /* Drop the headers about the connection to server */
+        if (strcmp(server_response, "\r\n") == 0) {
+            header_end = 1;
+        }
+        else if (!parse_response_header(server_response, response)) {
+            continue;
+        }
+        
+        /* Keep it for the cache */
+        save_header(fwd, content_len, server_response, read_len);
+        
+        /* Stop after all headers (include \r\n line) */
+        if (header_end) {
+            break;
+        }
+        
+        /* Forward to client later */
+        if (queue_data(connfd, client_data, &client_len, server_response, 
+        read_len) < 0) {
+            /* Close connection with remote server and return if error */
+            Close(proxyfd);
+            return -1;
+        }
     }
     
-    strcpy(uri, "/");
+    /* Client gets the headers about its connection before the empty line */
+    end_response_header(response);
     
-    /* Look for the port and uri (if possible) */
-    if (strstr(host_port_uri, "/") != NULL){ /* Extract uri */
-        sscanf(host_port_uri, "%[^/]%s", host_port, uri);
+    /* Our stale copy is still good, client gets it from the cache */
+    if (stale_block != NULL && response->status == 304) {
+        if (response->keep_alive && rio_server->rio_cnt == 0) {
+            upstream_checkin(upstream, host, port, proxyfd);
+        }
+        else {
+            Close(proxyfd);
+        }
+        return 1;
+    }
+    
+    *keep_alive_ptr = end_client_header(end_header, response, -1, 
+    *keep_alive_ptr);
+    
+    /* Don't keep a response the headers say can't be cached. The TTL is
+     * taken now, Expires without Date depends on the time the body ends */
+    *ttl_ptr = (my_cache != NULL) ? 
+    response_ttl(response, my_cache->default_ttl) : 0;
+    cacheable = (*ttl_ptr > 0 && !fwd->header.error && 
+    *content_len <= MAX_OBJECT_SIZE && (response->content_length < 0 || 
+    *content_len + response->content_length <= MAX_OBJECT_SIZE));
+    
+    /* Publish the headers, or let the readers go if it can't be cached. A
+     * body of unknown length may turn out too big on the way, the readers
+     * get it only once it's all received */
+    if (*fill_ptr != NULL) {
+        if (response->framing == BODY_CHUNKED || 
+        response->framing == BODY_CLOSE) {
+            hold_fill(*fill_ptr);
+        }
+        if (!cacheable || 
+        append_fill(*fill_ptr, fwd->header.data, fwd->header.len) < 0) {
+            abort_fill(my_cache, *fill_ptr);
+            *fill_ptr = NULL;
+        }
+    }
+    
+    /* Otherwise the response is accumulated in a buffer from the pool */
+    else if (cacheable && 
+    (fwd->content = get_buffer(fwd->buffers)) != NULL) {
+        memcpy(fwd->content, fwd->header.data, fwd->header.len);
+    }
+    free_http_buf(&fwd->header);
+    
+    /* The body already read with the headers goes with them */
+    read_len = 0;
+    if (response->framing == BODY_LENGTH || 
+    response->framing == BODY_CLOSE) {
+        read_len = rio_server->rio_cnt;
+        if (response->framing == BODY_LENGTH && 
+        response->content_length < read_len) {
+            read_len = response->content_length;
+        }
+        read_len = Rio_readnb_r(rio_server, server_response, read_len);
+        save_content(fwd, content_len, server_response, read_len, fill_ptr);
+    }
+    
+    /* Send headers and first body piece to client */
+    iov[0].iov_base = client_data;
+    iov[0].iov_len = client_len;
+    iov[1].iov_base = end_header;
+    iov[1].iov_len = strlen(end_header);
+    iov[2].iov_base = server_response;
+    iov[2].iov_len = read_len;
+    if (Rio_writev_r(connfd, iov, 3) < 0) {
+        /* Close connection with remote server and return if error, 
+         * unless the readers still need the rest */
+        if (*fill_ptr == NULL) {
+            Close(proxyfd);
+            return -1;
+        }
+        connfd = -1;
+    }
+    
+    /* Response body processing */
+    if (relay_body(&connfd, fwd, response, read_len, content_len, 
+    fill_ptr) < 0) {
+        /* Close connection with remote server and return if error */
+        Close(proxyfd);
+        return -1;
+    }
+    
+    /* Success, keep the connection with remote server if it's clean */
+    if (response->keep_alive && rio_server->rio_cnt == 0) {
+        upstream_checkin(upstream, host, port, proxyfd);
     }
     else {
-        sscanf(host_port_uri, "%s", host_port);
+        Close(proxyfd);
     }
     
-    /* Split host and port (if port is included) */
-    if ((strstr(host_port, ":")) != NULL){ /* Extract port */
-        sscanf(host_port, "%[^:]:%s", host, port);
+    return 0;
+}
+
+/*
+ * relay_body: Receive the response body from server by its framing and send
+ *      it to client (and cache). A chunked body is sent decoded, client
+ *      knows its end when we close. A body that won't be cached is moved
+ *      with relay_splice() (except a chunked one). The first sent bytes of
+ *      a body with length or ended by close are sent already.
+ * 
+ * return 0 = the whole body is received, -1 = error
+ */
+int 
+relay_body(int *connfd_ptr, forward_buf *fwd, http_response *response, 
+long sent, long *content_len, cache_block **fill_ptr) {
+    rio_t *rio_server = &fwd->rio_server;
+    char *server_response = fwd->line;
+    ssize_t read_len;
+    long chunk_len;
+    
+    switch (response->framing) {
+    case BODY_NONE:
+        return 0;
+    case BODY_LENGTH:
+        if (use_splice(*connfd_ptr, fwd, *content_len, 
+        response->content_length - sent, fill_ptr)) {
+            return relay_splice(*connfd_ptr, fwd, 
+            response->content_length - sent, content_len);
+        }
+        return relay_length(connfd_ptr, fwd, 
+        response->content_length - sent, content_len, fill_ptr);
+    case BODY_CHUNKED:
+        while (1) {
+            /* Chunk size line, chunk data and \r\n */
+            if (Rio_readlineb_r(rio_server, server_response, MAXLINE) <= 0 || 
+            (chunk_len = strtol(server_response, NULL, 16)) < 0) {
+                return -1;
+            }
+            
+            if (chunk_len == 0) {
+                break;
+            }
+            
+            if (relay_length(connfd_ptr, fwd, chunk_len, 
+            content_len, fill_ptr) < 0 || 
+            Rio_readlineb_r(rio_server, server_response, MAXLINE) <= 0) {
+                return -1;
+            }
+        }
         
-        /* double chekc port to if it is empty port*/
-        if (atoi(port) == 0) {
-            /* Apply fefault port if port is empty */
-            strcpy(port, default_port);
+        /* Skip the trailers until the empty line */
+        do {
+            if (Rio_readlineb_r(rio_server, server_response, MAXLINE) <= 0) {
+                return -1;
+            }
+        } while (strcmp(server_response, "\r\n") != 0);
+        return 0;
+    default: /* BODY_CLOSE */
+        while ((read_len = Rio_readnb_r(rio_server, 
+        server_response, MAXLINE)) > 0) {
+            if (relay_data(connfd_ptr, fwd, server_response, read_len, 
+            content_len, fill_ptr) < 0) {
+                return -1;
+            }
+            
+            /* Too big to cache now, the kernel moves the rest */
+            if (use_splice(*connfd_ptr, fwd, *content_len, -1, fill_ptr)) {
+                return relay_splice(*connfd_ptr, fwd, -1, content_len);
+            }
         }
+        return (read_len < 0) ? -1 : 0;
     }
-    else {
-        sscanf(host_port, "%s", host);
-        /* Apply default port */
-        strcpy(port, default_port);
+}
+
+/*
+ * relay_length: Receive exactly length bytes of body from server and send
+ *      them to client (and cache), through fwd->line
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+relay_length(int *connfd_ptr, forward_buf *fwd, long length, 
+long *content_len, cache_block **fill_ptr) {
+    char *server_response = fwd->line;
+    ssize_t read_len;
+    
+    while (length > 0) {
+        if ((read_len = Rio_readnb_r(&fwd->rio_server, server_response, 
+        length < MAXLINE ? length : MAXLINE)) <= 0) {
+            return -1; /* Server closed too early */
+        }
+        
+        if (relay_data(connfd_ptr, fwd, server_response, read_len, 
+        content_len, fill_ptr) < 0) {
+            return -1;
+        }
+        length -= read_len;
     }
     
-    /* Force using HTTP/1.0 if desired */
-    if (use_old_version) {
-        strcpy(ver, "HTTP/1.0");
+    return 0;
+}
+
+/*
+ * relay_data: Send a piece of response body to client and put it in cache
+ *      if available. If client is gone, *connfd_ptr is set to -1 and the
+ *      transfer goes on only for the readers of our placeholder.
+ * 
+ * return 0 = go on, -1 = nobody needs the rest
+ */
+int 
+relay_data(int *connfd_ptr, forward_buf *fwd, char *data, int len, 
+long *content_len, cache_block **fill_ptr) {
+    
+    if (DEBUG) { // display response body
+        if (SHOW_CONTENT) {
+            fprintf(stdout, "%.*s", len, data);
+        }
     }
     
-    /* Empty host*/
-    if (!strcmp(host, "")) {
+    /* Put data in cache if available */
+    save_content(fwd, content_len, data, len, fill_ptr);
+    
+    /* Client is gone and the fill was aborted, nobody needs the rest */
+    if (*connfd_ptr < 0 && *fill_ptr == NULL) {
         return -1;
     }
     
-    return 1;
+    if (*connfd_ptr >= 0 && Rio_writen_r(*connfd_ptr, data, len) < 0) {
+        /* Return if error, unless the readers still need the rest */
+        if (*fill_ptr == NULL) {
+            return -1;
+        }
+        *connfd_ptr = -1;
+    }
+    
+    return 0;
 }
 
 /*
- * construct_request_header: scanning the request from client to filter
- *      the headers. All of required header (Host, User-Agent, Accept, 
- *      Accept-Encoding, Connection and Proxy-Connection) will be modified to
- *      default value. Other headers from client will be forwarded normally.
+ * queue_data: Add data to out (MAXBUF bytes) to be sent to client later
+ *      with the rest of the headers. What is in out is sent first if data
+ *      doesn't fit.
+ * 
+ * return 0 = success, -1 = error
  */
-void 
-construct_request_header(rio_t *rio, 
-char *host, char *port, char *proxy_reqhdr) {
-    /* Header provided by client */
-    int host_hdr = 0;
-    int user_agent = 0;
-    int accept = 0;
-    int accept_encoding = 0;
-    int connection = 0;
-    int proxy_connection = 0;
-    char client_header[MAXLINE]; /* Buffer */
-    char host_buf[MAXLINE]; /* For bulding Host: header */
-    
-    /* Keep reading headers from client until we reach the empty line */
-    while (Rio_readlineb_r(rio, client_header, MAXLINE) != 0) {
-        /* According to RFC 2616, the sequence of header doesn't matter */
-        if (strcmp(client_header, "\r\n") == 0) {
-            break;
+int 
+queue_data(int connfd, char *out, int *out_len, char *data, int len) {
+    if (*out_len + len > MAXBUF) {
+        if (Rio_writen_r(connfd, out, *out_len) < 0) {
+            return -1;
         }
-        else if (strstr(client_header, "Host:") != NULL) {
-            strcat(proxy_reqhdr, client_header);
-            host_hdr = 1;
+        *out_len = 0;
+    }
+    
+    memcpy(out + *out_len, data, len);
+    *out_len += len;
+    
+    return 0;
+}
+
+/*
+ * use_splice: Check if the rest of the body can skip user space: client is
+ *      there, no reader streams it and it won't be cached (no response
+ *      buffer or the response is too big with length more bytes, -1 if
+ *      unknown). A fill or buffer that grows too big is let go by
+ *      save_content(), so a body ended by close moves to splice once it
+ *      passes the object limit.
+ * 
+ * return 1 = splice it, 0 = copy it
+ */
+int 
+use_splice(int connfd, forward_buf *fwd, long content_len, long length, 
+cache_block **fill_ptr) {
+    if (connfd < 0 || *fill_ptr != NULL) {
+        return 0;
+    }
+    
+    return (fwd->content == NULL || content_len > MAX_OBJECT_SIZE || 
+    (length >= 0 && content_len + length > MAX_OBJECT_SIZE));
+}
+
+/*
+ * relay_splice: Move length bytes of body (until server closes if length is
+ *      -1) from server to client through a pipe with splice(), the data
+ *      stays in the kernel. The bytes already in rio buffer of fwd are
+ *      sent first through fwd->line. *content_len keeps track of the total
+ *      response size.
+ * 
+ * return 0 = success, -1 = error
+ */
+int 
+relay_splice(int connfd, forward_buf *fwd, long length, long *content_len) {
+    rio_t *rio_server = &fwd->rio_server;
+    char *buffer = fwd->line;
+    int pipefd[2];
+    ssize_t read_len = 0, write_len;
+    long chunk;
+    
+    /* Data already read by rio */
+    while (rio_server->rio_cnt > 0 && length != 0) {
+        chunk = rio_server->rio_cnt;
+        if (length > 0 && length < chunk) {
+            chunk = length;
         }
-        else if (strstr(client_header, "User-Agent:") != NULL) {
-            strcat(proxy_reqhdr, user_agent_hdr);
-            user_agent = 1;
+        if (chunk > MAXLINE) {
+            chunk = MAXLINE;
         }
-        else if (strstr(client_header, "Accept-Encoding:") != NULL) {
-            strcat(proxy_reqhdr, accept_encoding_hdr);
-            accept_encoding = 1;
+        
+        read_len = Rio_readnb_r(rio_server, buffer, chunk);
+        if (Rio_writen_r(connfd, buffer, read_len) < 0) {
+            return -1;
         }
-        else if (strstr(client_header, "Accept:") != NULL) {
-            strcat(proxy_reqhdr, accept_hdr);
-            accept = 1;
+        
+        *content_len += read_len;
+        if (length > 0) {
+            length -= read_len;
+        }
+    }
+    
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    
+    while (length != 0) {
+        chunk = (length < 0 || length > SPLICE_SIZE) ? SPLICE_SIZE : length;
+        
+        /* Server to pipe */
+        if ((read_len = splice(rio_server->rio_fd, NULL, pipefd[1], NULL, 
+        chunk, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+            if (read_len < 0 && errno == EINTR) {
+                continue;
+            }
+            break; /* Server closed or error */
         }
-        else if (strstr(client_header, "Proxy-Connection:") != NULL) {
-            strcat(proxy_reqhdr, proxy_connection_hdr);
-            proxy_connection = 1;
+        
+        *content_len += read_len;
+        if (length > 0) {
+            length -= read_len;
         }
-        else if (strstr(client_header, "Connection:") != NULL) {
-            strcat(proxy_reqhdr, connection_hdr);
-            connection = 1;
+        
+        /* Pipe to client, until the pipe is empty */
+        while (read_len > 0) {
+            if ((write_len = splice(pipefd[0], NULL, connfd, NULL, 
+            read_len, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+                if (write_len < 0 && errno == EINTR) {
+                    continue;
+                }
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1; /* Client is gone */
+            }
+            read_len -= write_len;
         }
-        else { /* Other types of header tht is not mentioned in the writeup*/
-            strcat(proxy_reqhdr, client_header);
-        } 
     }
     
-    /* Add the missing required header */
-    /* Host */
-    if(!host_hdr) {
-        sprintf(host_buf, "Host: %s:%s\r\n", host, port);
-        strcat(proxy_reqhdr, host_buf);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    
+    /* Error, or server closed before length bytes */
+    return (read_len < 0 || length > 0) ? -1 : 0;
+}
+
+/*
+ * new_forward_buf: Allocate the buffers to forward a request, the response
+ *      buffer is taken from buffers later (if ever), see forward_request()
+ * 
+ * return the buffers, NULL if there is no memory
+ */
+forward_buf 
+*new_forward_buf(buffer_cache *buffers) {
+    forward_buf *fwd;
+    
+    if ((fwd = (forward_buf *)Malloc(sizeof(forward_buf))) == NULL) {
+        return NULL;
     }
-    /* User-Agent */
-    if (!user_agent) {
-        strcat(proxy_reqhdr, user_agent_hdr);
+    
+    init_http_buf(&fwd->header, fwd->header_storage, 
+    sizeof(fwd->header_storage));
+    fwd->buffers = buffers;
+    fwd->content = NULL;
+    return fwd;
+}
+
+/*
+ * free_forward_buf: Give the response buffer back and free the buffers of
+ *      a forwarded request, fwd may be NULL
+ */
+void 
+free_forward_buf(forward_buf *fwd) {
+    if (fwd == NULL) {
+        return;
     }
-    /* Accept-Enconding */
-    if (!accept_encoding) {
-        strcat(proxy_reqhdr, accept_encoding_hdr);
+    
+    put_buffer(fwd->buffers, fwd->content);
+    free_http_buf(&fwd->header);
+    Free(fwd);
+}
+
+/*
+ * save_header: Keep the status line or a header line of the response in
+ *      fwd->header until we know if the response can be cached, and keep
+ *      track of total response size. fwd->header.error is set once it
+ *      would be more than an object.
+ */
+void 
+save_header(forward_buf *fwd, long *content_len, char *data, int len) {
+    if (*content_len + len > MAX_OBJECT_SIZE) {
+        fwd->header.error = 1;
     }
-    /* Accept */
-    if (!accept) {
-        strcat(proxy_reqhdr, accept_hdr);
+    else if (!fwd->header.error) {
+        http_buf_append(&fwd->header, data, len);
     }
-    /* Proxy-Connection */
-    if (!proxy_connection) {
-        strcat(proxy_reqhdr, proxy_connection_hdr);
+    
+    /* Keep track of total response size */
+    *content_len += len;
+}
+
+/*
+ * save_content: Accumulate response data in fwd->content while it still
+ *      fits in an object and keep track of total response size. The buffer
+ *      is given back as soon as the response grows too big. If fill_ptr is
+ *      not NULL and we fill a placeholder, the data is appended to the
+ *      placeholder instead. It is aborted if that fails (the response grew
+ *      past the max object size), the rest can then be spliced.
+ */
+void 
+save_content(forward_buf *fwd, long *content_len, char *data, int len, 
+cache_block **fill_ptr) {
+    if (fill_ptr != NULL && *fill_ptr != NULL) {
+        if (append_fill(*fill_ptr, data, len) < 0) {
+            abort_fill(my_cache, *fill_ptr);
+            *fill_ptr = NULL;
+        }
     }
-    /* Connection */
-    if (!connection) {
-        strcat(proxy_reqhdr, connection_hdr);
+    else if (fwd->content != NULL) {
+        if (*content_len + len <= MAX_OBJECT_SIZE) {
+            /* Accumulate length and content */
+            memcpy(end_of_content(fwd->content, *content_len), 
+            (void *)data, len);
+        }
+        else {
+            /* Too big to cache, nobody needs the buffer */
+            put_buffer(fwd->buffers, fwd->content);
+            fwd->content = NULL;
+        }
     }
-    /*  End header lines with \r\n */
-    strcat(proxy_reqhdr, "\r\n");
+    
+    /* Keep track of total response size */
+    *content_len += len;
 }
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * read_request_line: read the request line from client into request. A
+ *      line longer than the rio buffer comes in pieces, they are joined up
+ *      to MAXLINE bytes.
+ * 
+ * return length of the line, 0 = client is done, error or line too long
  */
 int 
-open_clientfd_r(char *hostname, char *port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
-    int rv;
+read_request_line(rio_t *rio, http_buf *request) {
+    char *line; /* Piece of the line in rio buffer */
+    ssize_t read_len;
+    
+    do {
+        if ((read_len = Rio_readlinev_r(rio, &line)) <= 0 || 
+        request->len + read_len >= MAXLINE || 
+        http_buf_append(request, line, read_len) < 0) {
+            return 0;
+        }
+    } while (line[read_len - 1] != '\n');
+    
+    return (int)request->len;
+}
 
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
+/*
+ * read_request_header: read the headers from client until the empty line
+ *      into client_header, it grows up to REQUEST_HEADER_MAX bytes. A line
+ *      longer than the rio buffer comes in pieces, they are all kept so
+ *      lines are never cut. The headers are filtered to the headers sent
+ *      to the remote server later, see build_request_header() in http.c.
+ * 
+ * return 0 = success, -1 = headers too large (or no memory for them,
+ *      client_header->error is set)
+ */
+int 
+read_request_header(rio_t *rio, http_buf *client_header) {
+    char *header_line; /* Line in rio buffer */
+    ssize_t read_len;
+    
+    /* Keep reading headers from client until we reach the empty line,
+     * each line is copied once from rio buffer */
+    while ((read_len = Rio_readlinev_r(rio, &header_line)) > 0) {
+        if (read_len == 2 && !memcmp(header_line, "\r\n", 2)) {
+            break;
+        }
+        
+        if (client_header->len + read_len > REQUEST_HEADER_MAX || 
+        http_buf_append(client_header, header_line, read_len) < 0) {
+            return -1;
+        }
     }
+    
+    return 0;
+}
 
-    /* Get a list of addrinfo structs */
-    if ((rv = getaddrinfo(hostname, port, NULL, &addlist)) != 0) {
+/*
+ * open_listenfd_reuseport: open_listenfd() from CSAPP with SO_REUSEPORT, so
+ *      many sockets can listen on the same port
+ */
+int 
+open_listenfd_reuseport(int port) {
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+    
+    /* Create a socket descriptor */
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         return -1;
     }
-  
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if ((p->ai_family == AF_INET)) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
-            }
-        }
-    } 
+    
+    /* Eliminates "Address already in use" error and shares the port */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
+    (const void *)&optval , sizeof(int)) < 0 || 
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+    (const void *)&optval , sizeof(int)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    
+    /* Listenfd will be an endpoint for all requests to port
+       on any IP address for this host */
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET; 
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    serveraddr.sin_port = htons((unsigned short)port); 
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 || 
+    listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    
+    return listenfd;
+}
 
-    /* Clean up */
-    freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
+/*
+ * open_clientfd_r - thread-safe version of open_clientfd, the addresses
+ *      come from the resolver cache (see dns.h) and are raced with
+ *      connect_race() (see connect.h), IPv4 and IPv6
+ */
+int 
+open_clientfd_r(char *hostname, char *port) {
+    int clientfd, count, winner;
+    dns_addr addrs[DNS_MAX_ADDRS];
+    
+    /* Get the addresses, the last good one first */
+    if ((count = dns_resolve(dns, hostname, port, addrs)) < 0) {
         return -1;
     }
-    else { /* one of the connects succeeded */
-        return clientfd;
+    
+    /* First address that connects */
+    if ((clientfd = connect_race(addrs, count, connect_timeout, 
+    &winner)) < 0) {
+        return -1;
     }
+    
+    dns_connected(dns, hostname, port, (SA *)&addrs[winner].addr, 
+    addrs[winner].addrlen);
+    return clientfd;
 }
 
 /*
@@ -676,7 +1808,7 @@ void
 ssize_t 
 Rio_readnb_r(rio_t *rp, void *usrbuf, size_t n) {
     ssize_t rc;
-
+    
     if ((rc = rio_readnb(rp, usrbuf, n)) < 0) {
         if(errno != ECONNRESET){
             unix_error("Rio_readnb error");
@@ -694,7 +1826,7 @@ Rio_readnb_r(rio_t *rp, void *usrbuf, size_t n) {
 ssize_t 
 Rio_readlineb_r(rio_t *rp, void *usrbuf, size_t maxlen) {
     ssize_t rc;
-
+    
     if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
         if(errno != ECONNRESET){
             unix_error("Rio_readlineb error");
@@ -704,6 +1836,23 @@ Rio_readlineb_r(rio_t *rp, void *usrbuf, size_t maxlen) {
     return rc;
 } 
 
+/* 
+ * Rio_readlinev_r: rio_readlinev from csapp.c (line without copy) with the
+ *      error handling of Rio_readlineb_r.
+ */
+ssize_t 
+Rio_readlinev_r(rio_t *rp, char **linep) {
+    ssize_t rc;
+    
+    if ((rc = rio_readlinev(rp, linep)) < 0) {
+        if(errno != ECONNRESET){
+            unix_error("Rio_readlinev error");
+        }
+    }
+    
+    return rc;
+}
+
 /* 
  * Rio_writen_r: Modified Rio_writen from CSAPP. This verion will return rc.
  *      of the content read and will not call error if erro = EPIPE
@@ -711,7 +1860,7 @@ Rio_readlineb_r(rio_t *rp, void *usrbuf, size_t maxlen) {
 ssize_t 
 Rio_writen_r(int fd, void *usrbuf, size_t n) {
     ssize_t rc;
-
+    
     if ((rc = rio_writen(fd, usrbuf, n)) != n){
         if(errno != EPIPE){
             unix_error("Rio_writen error");
@@ -721,6 +1870,41 @@ Rio_writen_r(int fd, void *usrbuf, size_t n) {
     return rc;
 }
 
+/* 
+ * Rio_writev_r: Write all iovcnt buffers of iov with writev(), like
+ *      Rio_writen_r. iov is changed by the partial writes.
+ */
+ssize_t 
+Rio_writev_r(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t rc, total = 0;
+    
+    while (iovcnt > 0) {
+        if ((rc = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                unix_error("Rio_writev error");
+            }
+            return -1;
+        }
+        total += rc;
+        
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    
+    return total;
+}
+
 /*****************************************************************************
  * End helper functions
  *****************************************************************************/
\ No newline at end of file
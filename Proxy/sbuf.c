@@ -0,0 +1,148 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * sbuf.c: implementation of sbuf.h, bounded producer-consumer queue
+ */
+
+#include "sbuf.h"
+
+/* Functions prototype used only in sbuf.c */
+static unsigned long now_usec(void);
+static void put_item(sbuf_t *sp, int item);
+
+/* Functions */
+
+/*
+ * sbuf_init: Create an empty, bounded, shared FIFO buffer with n slots
+ */
+void 
+sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(sbuf_item));
+    sp->n = n; /* Buffer holds max of n items */
+    sp->front = sp->rear = 0; /* Empty buffer iff front == rear */
+    memset(&sp->stats, 0, sizeof(sbuf_stats));
+    Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0); /* Initially, buf has zero data items */
+}
+
+/*
+ * sbuf_deinit: Clean up buffer sp
+ */
+void 
+sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+}
+
+/*
+ * now_usec: Monotonic clock in microseconds
+ */
+unsigned long 
+now_usec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * put_item: Insert item onto the rear of shared buffer sp, the caller has
+ *      taken a slot already
+ */
+void 
+put_item(sbuf_t *sp, int item) {
+    sbuf_item *item_ptr;
+    
+    P(&sp->mutex); /* Lock the buffer */
+    item_ptr = &sp->buf[(++sp->rear) % (sp->n)]; /* Insert the item */
+    item_ptr->item = item;
+    item_ptr->time = now_usec();
+    V(&sp->mutex); /* Unlock the buffer */
+    V(&sp->items); /* Announce available item */
+}
+
+/*
+ * sbuf_insert: Insert item onto the rear of shared buffer sp, wait if the
+ *      buffer is full
+ */
+void 
+sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots); /* Wait for available slot */
+    put_item(sp, item);
+}
+
+/*
+ * sbuf_tryinsert: Insert item onto the rear of shared buffer sp if there is
+ *      an available slot
+ * 
+ * return 1 = inserted, -1 = buffer is full
+ */
+int 
+sbuf_tryinsert(sbuf_t *sp, int item) {
+    if (sem_trywait(&sp->slots) < 0) {
+        P(&sp->mutex);
+        sp->stats.rejected += 1;
+        V(&sp->mutex);
+        return -1;
+    }
+    
+    put_item(sp, item);
+    return 1;
+}
+
+/*
+ * sbuf_remove: Remove and return the first item from buffer sp, wait if
+ *      the buffer is empty
+ */
+int 
+sbuf_remove(sbuf_t *sp) {
+    sbuf_item *item_ptr;
+    unsigned long wait_usec;
+    int item;
+    
+    P(&sp->items); /* Wait for available item */
+    P(&sp->mutex); /* Lock the buffer */
+    item_ptr = &sp->buf[(++sp->front) % (sp->n)]; /* Remove the item */
+    item = item_ptr->item;
+    
+    /* Time spent in queue */
+    wait_usec = now_usec() - item_ptr->time;
+    sp->stats.removed += 1;
+    sp->stats.wait_usec += wait_usec;
+    if (wait_usec > sp->stats.max_wait_usec) {
+        sp->stats.max_wait_usec = wait_usec;
+    }
+    
+    V(&sp->mutex); /* Unlock the buffer */
+    V(&sp->slots); /* Announce available slot */
+    return item;
+}
+
+/*
+ * get_sbuf_stats: Copy the statistics of buffer sp
+ */
+void 
+get_sbuf_stats(sbuf_t *sp, sbuf_stats *stats) {
+    P(&sp->mutex);
+    *stats = sp->stats;
+    stats->waiting = sp->rear - sp->front;
+    V(&sp->mutex);
+}
+
+/*
+ * print_sbuf_stats: Print the queue wait time of the removed items and the
+ *      number of items waiting or rejected to fp.
+ */
+void 
+print_sbuf_stats(sbuf_t *sp, FILE *fp) {
+    sbuf_stats stats;
+    
+    get_sbuf_stats(sp, &stats);
+    
+    fprintf(fp, "Queue: %lu served, %d waiting, %lu rejected, "
+    "avg wait %.3f ms, max wait %.3f ms\n", stats.removed, stats.waiting, 
+    stats.rejected, 
+    stats.removed ? (double)stats.wait_usec / stats.removed / 1000 : 0.0, 
+    (double)stats.max_wait_usec / 1000);
+}
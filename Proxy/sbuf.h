@@ -0,0 +1,55 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * sbuf.h: header file for the bounded connection queue of the worker pool
+ *     This is the sbuf package from CSAPP (a circular buffer protected by a
+ *     mutex, slots and items semaphores). The main thread inserts the
+ *     accepted connections and the worker threads remove them. 
+ * 
+ * Overflow: sbuf_insert() waits for a free slot, sbuf_tryinsert() gives up
+ *     right away if the queue is full so the caller can reject it.
+ * 
+ * Statistics: Each item keeps the time it was inserted, so the queue knows
+ *     how long the connections waited for a worker.
+ */
+
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct sbuf_item {
+    int item;
+    unsigned long time; /* Insert time in microseconds */
+} sbuf_item;
+
+typedef struct sbuf_stats {
+    unsigned long removed; /* Items taken by workers */
+    unsigned long rejected; /* Items not inserted because queue was full */
+    unsigned long wait_usec; /* Total wait of removed items */
+    unsigned long max_wait_usec;
+    int waiting; /* Items in queue now */
+} sbuf_stats;
+
+typedef struct {
+    sbuf_item *buf; /* Buffer array */
+    int n; /* Maximum number of slots */
+    int front; /* buf[(front+1)%n] is first item */
+    int rear; /* buf[rear%n] is last item */
+    sbuf_stats stats; /* Protected by mutex */
+    sem_t mutex; /* Protects accesses to buf */
+    sem_t slots; /* Counts available slots */
+    sem_t items; /* Counts available items */
+} sbuf_t;
+
+/* Functions used in proxy.c */
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void get_sbuf_stats(sbuf_t *sp, sbuf_stats *stats);
+void print_sbuf_stats(sbuf_t *sp, FILE *fp);
+
+#endif /* __SBUF_H__ */
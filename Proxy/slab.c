@@ -0,0 +1,190 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * slab.c: implementation of slab.h, size class arena for cache blocks
+ */
+
+#include "slab.h"
+
+/* Functions prototype used only in slab.c */
+static slab_class *find_class(slab_arena *arena, size_t size);
+
+/* Functions */
+
+/*
+ * init_slab_arena: Pick the slab size for slab_limit and build the size
+ *      classes of a new arena. No slab is taken until the first allocation
+ *      of each class.
+ * 
+ * return arena pointer if success, NULL if not enough space
+ */
+slab_arena 
+*init_slab_arena(size_t slab_limit) {
+    slab_arena *arena;
+    slab_class *class_ptr;
+    size_t chunk_size = SLAB_MIN_CHUNK;
+    
+    /* Allocate space */
+    if ((arena = (slab_arena *)Malloc(sizeof(slab_arena))) == NULL) {
+        return NULL;
+    }
+    
+    arena->class_count = 0;
+    arena->slab_bytes = 0;
+    arena->slab_limit = slab_limit;
+    
+    /* Biggest slab that still lets the limit hold SLAB_COUNT of them */
+    arena->slab_size = SLAB_MIN_SIZE;
+    while (arena->slab_size < SLAB_MAX_SIZE && 
+    arena->slab_size * 2 * SLAB_COUNT <= slab_limit) {
+        arena->slab_size *= 2;
+    }
+    
+    /* Chunk sizes grow by SLAB_GROWTH, the last class is a whole slab */
+    while (arena->class_count < SLAB_MAX_CLASSES) {
+        chunk_size = (chunk_size + SLAB_ALIGN - 1) & 
+        ~(size_t)(SLAB_ALIGN - 1);
+        if (chunk_size > arena->slab_size || 
+        arena->class_count == SLAB_MAX_CLASSES - 1) {
+            chunk_size = arena->slab_size;
+        }
+        
+        class_ptr = &arena->classes[arena->class_count];
+        class_ptr->chunk_size = chunk_size;
+        class_ptr->free_list = NULL;
+        class_ptr->slab_ptr = NULL;
+        class_ptr->slab_left = 0;
+        class_ptr->arena = arena;
+        Sem_init(&class_ptr->mutex, 0, 1);
+        arena->class_count += 1;
+        
+        if (chunk_size == arena->slab_size) {
+            break;
+        }
+        chunk_size = (size_t)(chunk_size * SLAB_GROWTH);
+    }
+    
+    return arena;
+}
+
+/*
+ * find_class: Return the smallest class that can hold size bytes (binary
+ *      search, chunk sizes are increasing)
+ */
+slab_class 
+*find_class(slab_arena *arena, size_t size) {
+    int low = 0, high = arena->class_count - 1, mid;
+    
+    if (size > arena->classes[high].chunk_size) {
+        return NULL;
+    }
+    
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (arena->classes[mid].chunk_size < size) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    
+    return &arena->classes[low];
+}
+
+/*
+ * slab_alloc: Take a chunk of at least size bytes. Reuse a free chunk of
+ *      the class first, then carve a new chunk from the newest slab, then
+ *      take a new slab if the arena is still under its limit. Otherwise
+ *      fall back to Malloc. *class_ptr is set to the class of the chunk
+ *      (NULL for Malloc) and must be given back to slab_free().
+ * 
+ * return chunk pointer if success, NULL if not enough space
+ */
+void 
+*slab_alloc(slab_arena *arena, size_t size, slab_class **class_ptr) {
+    slab_class *size_class;
+    slab_chunk *chunk_ptr;
+    char *slab_ptr;
+    
+    *class_ptr = NULL;
+    
+    if ((size_class = find_class(arena, size)) == NULL) {
+        return Malloc(size);
+    }
+    
+    P(&size_class->mutex);
+    
+    /* Reuse a free chunk */
+    if ((chunk_ptr = size_class->free_list) != NULL) {
+        size_class->free_list = chunk_ptr->next;
+        V(&size_class->mutex);
+        *class_ptr = size_class;
+        return (void *)chunk_ptr;
+    }
+    
+    /* Take a new slab when the newest one is used up */
+    if (size_class->slab_left == 0) {
+        if (__sync_add_and_fetch(&arena->slab_bytes, arena->slab_size) > 
+        arena->slab_limit) {
+            /* Arena is full */
+            __sync_sub_and_fetch(&arena->slab_bytes, arena->slab_size);
+            V(&size_class->mutex);
+            return Malloc(size);
+        }
+        
+        if ((slab_ptr = (char *)Malloc(arena->slab_size)) == NULL) {
+            __sync_sub_and_fetch(&arena->slab_bytes, arena->slab_size);
+            V(&size_class->mutex);
+            return NULL;
+        }
+        
+        size_class->slab_ptr = slab_ptr;
+        size_class->slab_left = arena->slab_size / size_class->chunk_size;
+    }
+    
+    /* Carve the next chunk */
+    chunk_ptr = (slab_chunk *)size_class->slab_ptr;
+    size_class->slab_ptr += size_class->chunk_size;
+    size_class->slab_left -= 1;
+    
+    V(&size_class->mutex);
+    
+    *class_ptr = size_class;
+    return (void *)chunk_ptr;
+}
+
+/*
+ * slab_chunk_size: Bytes a request of size bytes takes, the chunk size of
+ *      its class (or size itself if it's bigger than a slab). A chunk
+ *      taken from Malloc when the arena is full is counted the same.
+ */
+size_t 
+slab_chunk_size(slab_arena *arena, size_t size) {
+    slab_class *size_class;
+    
+    if ((size_class = find_class(arena, size)) == NULL) {
+        return size;
+    }
+    return size_class->chunk_size;
+}
+
+/*
+ * slab_free: Give the chunk back to the free list of its class (or to Free
+ *      if it came from Malloc)
+ */
+void 
+slab_free(slab_class *class_ptr, void *chunk_ptr) {
+    slab_chunk *free_ptr = (slab_chunk *)chunk_ptr;
+    
+    if (class_ptr == NULL) {
+        Free(chunk_ptr);
+        return;
+    }
+    
+    P(&class_ptr->mutex);
+    free_ptr->next = class_ptr->free_list;
+    class_ptr->free_list = free_ptr;
+    V(&class_ptr->mutex);
+}
@@ -0,0 +1,69 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * slab.h: header file for the slab arena used by the cache
+ *     The arena hands out chunks from a set of size classes. Each class
+ *     has a fixed chunk size, the sizes grow by SLAB_GROWTH from
+ *     SLAB_MIN_CHUNK up to the slab size. Chunks are carved from slabs
+ *     taken from Malloc, and freed chunks go back to the free list of
+ *     their class to be reused. So the allocator is called once per slab
+ *     instead of once per object.
+ * 
+ * Slab size: A slab is the biggest power of 2 (from a page up to
+ *     SLAB_MAX_SIZE) that lets slab_limit hold SLAB_COUNT slabs, so every
+ *     class can take a few slabs however small the cache is. SLAB_GROWTH
+ *     keeps the classes few (15 for a 32 KB slab).
+ * 
+ * Limit: The arena stops taking new slabs once it holds slab_limit bytes.
+ *     After that (and for requests bigger than a slab) a chunk is taken
+ *     from Malloc directly and given back to Free. With the default cache
+ *     size the slabs are 32 KB, so cached objects from 32 KB up to the
+ *     max object size always come from Malloc. slab_chunk_size() tells
+ *     the bytes a request really takes, for the space accounting.
+ * 
+ * Synchronization: Each class has its own mutex, so allocations of
+ *     different sizes never wait for each other.
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+#define SLAB_MIN_SIZE 4096 /* Smallest slab, a page */
+#define SLAB_MAX_SIZE (1 << 20) /* Biggest slab */
+#define SLAB_COUNT 64 /* Slabs that fit in slab_limit */
+#define SLAB_MIN_CHUNK 128 /* Smallest chunk */
+#define SLAB_GROWTH 1.5 /* Chunk size factor between classes */
+#define SLAB_ALIGN 8 /* Chunk sizes are multiple of this */
+#define SLAB_MAX_CLASSES 32
+
+typedef struct slab_chunk {
+    struct slab_chunk *next; /* Next free chunk of the class */
+} slab_chunk;
+
+typedef struct slab_class {
+    size_t chunk_size;
+    slab_chunk *free_list;
+    char *slab_ptr; /* Next never used chunk in the newest slab */
+    size_t slab_left; /* Number of never used chunks in the newest slab */
+    struct slab_arena *arena;
+    sem_t mutex;
+} slab_class;
+
+typedef struct slab_arena {
+    size_t slab_size; /* Bytes per slab, also the biggest chunk */
+    int class_count;
+    slab_class classes[SLAB_MAX_CLASSES];
+    size_t slab_bytes; /* Bytes taken for slabs so far, updated atomically */
+    size_t slab_limit; /* No new slab beyond this */
+} slab_arena;
+
+/* Functions used in cache.c */
+slab_arena *init_slab_arena(size_t slab_limit);
+void *slab_alloc(slab_arena *arena, size_t size, slab_class **class_ptr);
+size_t slab_chunk_size(slab_arena *arena, size_t size);
+void slab_free(slab_class *class_ptr, void *chunk_ptr);
+
+#endif /* __SLAB_H__ */
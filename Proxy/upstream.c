@@ -0,0 +1,408 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * upstream.c: implementation of upstream.h, keep-alive connection pool
+ */
+
+#include "upstream.h"
+
+/* Functions prototype used only in upstream.c */
+static unsigned long now_sec(void);
+static int make_key(char *host, char *port, char *key);
+static unsigned int hash_key(char *key);
+static upstream_origin *find_origin(upstream_pool *pool, char *key, 
+unsigned int hash, int create);
+static void expire_idle(upstream_pool *pool, upstream_origin *origin, 
+unsigned long now);
+static void sweep(upstream_pool *pool, unsigned long now);
+static int conn_alive(int fd);
+
+/* Functions */
+
+/*
+ * init_upstream_pool: Create an empty pool
+ * 
+ * return pool pointer if success, NULL if not enough space
+ */
+upstream_pool 
+*init_upstream_pool(int max_idle, int idle_timeout, int max_active) {
+    upstream_pool *pool;
+    int i;
+    
+    if ((pool = (upstream_pool *)Malloc(sizeof(upstream_pool))) == NULL) {
+        return NULL;
+    }
+    
+    pool->max_idle = max_idle;
+    pool->max_active = max_active;
+    pool->idle_timeout = idle_timeout;
+    pool->last_sweep = now_sec();
+    for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+        pool->buckets[i] = NULL;
+    }
+    pool->reused = 0;
+    pool->checked_in = 0;
+    pool->refused = 0;
+    Sem_init(&pool->mutex, 0, 1);
+    
+    return pool;
+}
+
+/*
+ * now_sec: Monotonic clock in seconds
+ */
+unsigned long 
+now_sec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec;
+}
+
+/*
+ * make_key: Write host:port to key
+ * 
+ * return 1 = success, -1 = too long to be pooled
+ */
+int 
+make_key(char *host, char *port, char *key) {
+    if (snprintf(key, UPSTREAM_KEY_SIZE, "%s:%s", host, port) >= 
+    UPSTREAM_KEY_SIZE) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * hash_key: FNV-1a hash of the key
+ */
+unsigned int 
+hash_key(char *key) {
+    unsigned int hash = 2166136261u;
+    
+    while (*key != '\0') {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * find_origin: Search the origin of key, create it if not found and create
+ *      is set. Must be called with the mutex.
+ * 
+ * return origin pointer, NULL if not found (or not enough space)
+ */
+upstream_origin 
+*find_origin(upstream_pool *pool, char *key, unsigned int hash, 
+int create) {
+    upstream_origin *origin;
+    upstream_origin **bucket = &pool->buckets[hash % UPSTREAM_BUCKETS];
+    
+    for (origin = *bucket; origin != NULL; origin = origin->next) {
+        if (origin->hash == hash && !strcmp(origin->key, key)) {
+            return origin;
+        }
+    }
+    
+    if (!create || 
+    (origin = (upstream_origin *)Malloc(sizeof(upstream_origin))) == NULL) {
+        return NULL;
+    }
+    
+    strcpy(origin->key, key);
+    origin->hash = hash;
+    origin->idle_count = 0;
+    origin->idle = NULL;
+    origin->active = 0;
+    origin->waiting = 0;
+    Sem_init(&origin->slot, 0, 0);
+    origin->next = *bucket;
+    *bucket = origin;
+    
+    return origin;
+}
+
+/*
+ * expire_idle: Close the connections of the origin that are idle for too
+ *      long. The stack is in check in order, so they are all at the bottom.
+ *      Must be called with the mutex.
+ */
+void 
+expire_idle(upstream_pool *pool, upstream_origin *origin, unsigned long now) {
+    upstream_conn **link_ptr = &origin->idle;
+    upstream_conn *conn_ptr, *next_ptr;
+    
+    /* Find the first expired connection */
+    while (*link_ptr != NULL && 
+    now - (*link_ptr)->idle_since < (unsigned long)pool->idle_timeout) {
+        link_ptr = &(*link_ptr)->next;
+    }
+    
+    /* Cut it and everything older */
+    conn_ptr = *link_ptr;
+    *link_ptr = NULL;
+    while (conn_ptr != NULL) {
+        next_ptr = conn_ptr->next;
+        close(conn_ptr->fd);
+        Free(conn_ptr);
+        origin->idle_count -= 1;
+        conn_ptr = next_ptr;
+    }
+}
+
+/*
+ * sweep: Expire the idle connections of every origin and free the origins
+ *      left with none (and no slot held or waited for), at most once per
+ *      idle_timeout. Must be called with the mutex.
+ */
+void 
+sweep(upstream_pool *pool, unsigned long now) {
+    upstream_origin **link_ptr, *origin;
+    int i;
+    
+    if (now - pool->last_sweep < (unsigned long)pool->idle_timeout) {
+        return;
+    }
+    pool->last_sweep = now;
+    
+    for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+        link_ptr = &pool->buckets[i];
+        while ((origin = *link_ptr) != NULL) {
+            expire_idle(pool, origin, now);
+            if (origin->idle_count == 0 && origin->active == 0 && 
+            origin->waiting == 0) {
+                *link_ptr = origin->next;
+                sem_destroy(&origin->slot);
+                Free(origin);
+            }
+            else {
+                link_ptr = &origin->next;
+            }
+        }
+    }
+}
+
+/*
+ * conn_alive: Check that an idle connection is still open and has nothing
+ *      to read (the server can't send anything before our request)
+ * 
+ * return 1 = alive, 0 = dead
+ */
+int 
+conn_alive(int fd) {
+    char byte;
+    ssize_t rc;
+    
+    rc = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    
+    return (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/*
+ * upstream_acquire: Take a slot of host:port before connecting to it, wait
+ *      up to timeout_ms milliseconds if all max_active are held. Always
+ *      succeeds without pool, limit or a key that can be pooled.
+ * 
+ * return 0 = success (give it back with upstream_release()), -1 = refused
+ */
+int 
+upstream_acquire(upstream_pool *pool, char *host, char *port, 
+int timeout_ms) {
+    char key[UPSTREAM_KEY_SIZE];
+    upstream_origin *origin;
+    struct timespec deadline;
+    int rc;
+    
+    if (pool == NULL || pool->max_active == 0 || 
+    make_key(host, port, key) < 0) {
+        return 0;
+    }
+    
+    P(&pool->mutex);
+    
+    /* A free slot, or no memory to track the origin */
+    if ((origin = find_origin(pool, key, hash_key(key), 1)) == NULL || 
+    origin->active < pool->max_active) {
+        if (origin != NULL) {
+            origin->active += 1;
+        }
+        V(&pool->mutex);
+        return 0;
+    }
+    origin->waiting += 1;
+    
+    V(&pool->mutex);
+    
+    /* sem_timedwait() takes the time of day */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    do {
+        rc = sem_timedwait(&origin->slot, &deadline);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) {
+        return 0; /* Release counted us out of waiting */
+    }
+    
+    /* Timed out, but a slot may have been handed over since */
+    P(&pool->mutex);
+    if ((rc = sem_trywait(&origin->slot)) < 0) {
+        origin->waiting -= 1;
+        pool->refused += 1;
+    }
+    V(&pool->mutex);
+    
+    return (rc == 0) ? 0 : -1;
+}
+
+/*
+ * upstream_release: Give back the slot of host:port taken by
+ *      upstream_acquire(), straight to a waiter if there is one
+ */
+void 
+upstream_release(upstream_pool *pool, char *host, char *port) {
+    char key[UPSTREAM_KEY_SIZE];
+    upstream_origin *origin;
+    
+    if (pool == NULL || pool->max_active == 0 || 
+    make_key(host, port, key) < 0) {
+        return;
+    }
+    
+    P(&pool->mutex);
+    
+    if ((origin = find_origin(pool, key, hash_key(key), 0)) != NULL) {
+        if (origin->waiting > 0) {
+            origin->waiting -= 1;
+            V(&origin->slot);
+        }
+        else if (origin->active > 0) {
+            origin->active -= 1;
+        }
+    }
+    
+    V(&pool->mutex);
+}
+
+/*
+ * upstream_checkout: Take a live idle connection to host:port
+ * 
+ * return connection fd, -1 if there is none
+ */
+int 
+upstream_checkout(upstream_pool *pool, char *host, char *port) {
+    char key[UPSTREAM_KEY_SIZE];
+    unsigned int hash;
+    unsigned long now;
+    upstream_origin *origin;
+    upstream_conn *conn_ptr;
+    int fd;
+    
+    if (pool == NULL || make_key(host, port, key) < 0) {
+        return -1;
+    }
+    hash = hash_key(key);
+    now = now_sec();
+    
+    while (1) {
+        P(&pool->mutex);
+        
+        sweep(pool, now);
+        
+        /* Pop the most recently used connection */
+        conn_ptr = NULL;
+        if ((origin = find_origin(pool, key, hash, 0)) != NULL) {
+            expire_idle(pool, origin, now);
+            if ((conn_ptr = origin->idle) != NULL) {
+                origin->idle = conn_ptr->next;
+                origin->idle_count -= 1;
+            }
+        }
+        
+        V(&pool->mutex);
+        
+        if (conn_ptr == NULL) {
+            return -1;
+        }
+        
+        fd = conn_ptr->fd;
+        Free(conn_ptr);
+        
+        /* Check outside of the lock, try the next one if it's closed */
+        if (conn_alive(fd)) {
+            P(&pool->mutex);
+            pool->reused += 1;
+            V(&pool->mutex);
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * upstream_checkin: Give a connection to host:port back to the pool after a
+ *      complete response. It is closed if the origin has enough idle
+ *      connections already.
+ */
+void 
+upstream_checkin(upstream_pool *pool, char *host, char *port, int fd) {
+    char key[UPSTREAM_KEY_SIZE];
+    unsigned int hash;
+    unsigned long now;
+    upstream_origin *origin;
+    upstream_conn *conn_ptr;
+    
+    if (pool == NULL || make_key(host, port, key) < 0 || 
+    (conn_ptr = (upstream_conn *)Malloc(sizeof(upstream_conn))) == NULL) {
+        close(fd);
+        return;
+    }
+    hash = hash_key(key);
+    now = now_sec();
+    
+    P(&pool->mutex);
+    
+    if ((origin = find_origin(pool, key, hash, 1)) != NULL) {
+        expire_idle(pool, origin, now);
+    }
+    
+    /* Origin has enough */
+    if (origin == NULL || origin->idle_count >= pool->max_idle) {
+        V(&pool->mutex);
+        close(fd);
+        Free(conn_ptr);
+        return;
+    }
+    
+    conn_ptr->fd = fd;
+    conn_ptr->idle_since = now;
+    conn_ptr->next = origin->idle;
+    origin->idle = conn_ptr;
+    origin->idle_count += 1;
+    pool->checked_in += 1;
+    
+    V(&pool->mutex);
+}
+
+/*
+ * print_upstream_stats: Print how many connections were given back to the
+ *      pool and reused, and how many requests got no slot to fp.
+ */
+void 
+print_upstream_stats(upstream_pool *pool, FILE *fp) {
+    unsigned long reused, checked_in, refused;
+    
+    P(&pool->mutex);
+    reused = pool->reused;
+    checked_in = pool->checked_in;
+    refused = pool->refused;
+    V(&pool->mutex);
+    
+    fprintf(fp, "Upstream: %lu connections kept, %lu reused, %lu refused\n", 
+    checked_in, reused, refused);
+}
@@ -0,0 +1,86 @@
+/*
+ * Name: Punnawachara Campanang
+ * Andrew ID: pcampana
+ * 
+ * upstream.h: header file for the pool of keep-alive connections to the
+ *     remote servers
+ *     After a response that leaves the connection open, the proxy gives the
+ *     connection back to the pool with upstream_checkin() instead of
+ *     closing it. The next request to the same host:port takes it with
+ *     upstream_checkout() and skips getaddrinfo, socket and connect.
+ * 
+ * Structure: The pool is a hash table of origins (host:port). Each origin
+ *     keeps a stack of its idle connections, the most recently used one is
+ *     taken first so the others can time out.
+ * 
+ * Limits: An origin keeps at most max_idle idle connections, the extra
+ *     ones are closed at check in. A connection idle for more than
+ *     idle_timeout seconds is closed when its origin is used or when the
+ *     whole pool is swept (at most once per idle_timeout).
+ * 
+ * Active connections: A request holds one of the max_active slots of its
+ *     origin from upstream_acquire() to upstream_release(), whether its
+ *     connection is reused or new, so a burst of misses to one server
+ *     can't open unbounded connections to it. When all slots are taken
+ *     the request waits for one (the slot is handed straight to a waiter
+ *     at release), and is refused if none is free in time.
+ * 
+ * Liveness: A connection taken from the pool is checked with a
+ *     non-blocking peek first. If the server has closed it (or sent
+ *     something we didn't ask for), it is closed and the next one is tried.
+ *     The server may still close it right after the check, so the caller
+ *     should retry on a new connection if a reused one fails before any
+ *     response comes.
+ * 
+ * Synchronization: One mutex protects the whole pool. It is only held to
+ *     push or pop a connection, never during network I/O.
+ */
+
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+#define UPSTREAM_BUCKETS 256
+#define UPSTREAM_KEY_SIZE 512 /* Longer host:port is never pooled */
+
+typedef struct upstream_conn {
+    int fd;
+    unsigned long idle_since; /* Time of check in in seconds */
+    struct upstream_conn *next; /* Next idle connection of the origin */
+} upstream_conn;
+
+typedef struct upstream_origin {
+    char key[UPSTREAM_KEY_SIZE]; /* host:port */
+    unsigned hash;
+    int idle_count;
+    upstream_conn *idle; /* Stack of idle connections */
+    int active; /* Slots held by requests */
+    int waiting; /* Requests waiting for a slot */
+    sem_t slot; /* Posted once for each slot handed to a waiter */
+    struct upstream_origin *next; /* Next origin in the bucket */
+} upstream_origin;
+
+typedef struct upstream_pool {
+    int max_idle; /* Idle connections kept per origin */
+    int max_active; /* Slots per origin, 0 = no limit */
+    int idle_timeout; /* Seconds */
+    unsigned long last_sweep;
+    upstream_origin *buckets[UPSTREAM_BUCKETS];
+    unsigned long reused; /* Statistics, protected by mutex */
+    unsigned long checked_in;
+    unsigned long refused; /* No slot in time */
+    sem_t mutex;
+} upstream_pool;
+
+/* Functions used in proxy.c */
+upstream_pool *init_upstream_pool(int max_idle, int idle_timeout, 
+int max_active);
+int upstream_acquire(upstream_pool *pool, char *host, char *port, 
+int timeout_ms);
+void upstream_release(upstream_pool *pool, char *host, char *port);
+int upstream_checkout(upstream_pool *pool, char *host, char *port);
+void upstream_checkin(upstream_pool *pool, char *host, char *port, int fd);
+void print_upstream_stats(upstream_pool *pool, FILE *fp);
+
+#endif /* __UPSTREAM_H__ */